@@ -3,205 +3,4393 @@
 #include <linux/kdev_t.h>
 #include <linux/fs.h>
 #include <linux/cdev.h>
+#include <linux/slab.h>
+#include <linux/kref.h>
+#include <linux/xarray.h>
+#include <linux/overflow.h>
+#include <linux/log2.h>
+#include <linux/crc32.h>
+#include <linux/crc32c.h>
+#include <linux/string.h>
+#include <linux/file.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/kthread.h>
+#include <linux/mm.h>
+#include <linux/mmu_notifier.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/sched/signal.h>
+#include <linux/scatterlist.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <asm/unaligned.h>
 
 #include <linux/dma-buf.h>
+#include <linux/dma-resv.h>
 #include <linux/dma-mapping.h>
+#include <linux/dma-direct.h>
+#include <linux/dma-fence.h>
+#include <linux/sync_file.h>
 
 #include "hello.h"
 
-static unsigned int majorA = 222;
-static unsigned int majorB = 223;
-static dev_t dev_noA;
-static dev_t dev_noB;
-static struct class* clsA = NULL;
-static struct class* clsB = NULL;
-static struct device* cls_devA = NULL;
-static struct device* cls_devB = NULL;
+#define CREATE_TRACE_POINTS
+#include "hello_trace.h"
 
+static unsigned int ndevs = 2;
+module_param(ndevs, uint, 0444);
+MODULE_PARM_DESC(ndevs, "Number of importer devices, cdriverA, cdriverB, ...");
+
+static dev_t hello_devt;
+static struct class *hello_cls;
 struct dma_buf_dev {
+    struct cdev cdev;
+    struct device *dev;
+    u64 dma_mask;
+    enum dma_data_direction dir;
+    char name[16];
+    char str[32];
+    struct hello_stats __percpu *stats;
+    struct dentry *debugfs;
+};
+
+static struct dma_buf_dev *hello_devs;
+
+static struct dma_buf_dev *hello_inode_to_dev(struct inode *inode, struct file *file)
+{
+    return container_of(inode->i_cdev, struct dma_buf_dev, cdev);
+}
+
+/* per-open-file state, nothing in here is shared between clients */
+struct hello_file {
+    struct kref ref;
+    struct dma_buf_dev *hdev;
+    /* imported buffers, indexed by handle */
+    struct xarray bufs;
+    /* async submissions not yet signalled, see hello_job */
+    atomic_t inflight;
+    wait_queue_head_t wait;
+    /* pinned user ranges, most recently used first, see hello_userptr */
+    struct mutex userptr_lock;
+    struct list_head userptrs;
+    unsigned int nr_userptrs;
+    /* submission/completion rings, set up once, see hello_ring */
+    struct hello_ring *ring;
+};
+
+/* a dma-buf kept attached and mapped between ioctls */
+struct hello_buf {
+    struct kref ref;
+    struct dma_buf_dev *hdev;
     struct dma_buf *dma_buf;
     struct dma_buf_attachment *attach;
+    /*
+     * Current mapping, NULL after the exporter moved the buffer until the
+     * next use maps it again. Protected by the dma-buf's reservation lock,
+     * see hello_buf_pin_sgt() for using it without holding that.
+     */
     struct sg_table *sg;
+    enum dma_data_direction dir;
+    /*
+     * kernel mapping, set up on first cpu access and kept until free or
+     * until the exporter moves the buffer. A move only marks it stale,
+     * the next user, which has the buffer pinned, maps it again.
+     */
+    struct mutex lock;
     void *vaddr;
-    struct device *dev;
+    bool vaddr_stale;
+    /* bytes of the mapping that swiotlb bounces */
+    u64 bounced;
+};
+
+/*
+ * An async submission. The job is its own fence: it is signalled from
+ * the worker and freed once the last sync_file reference goes away.
+ */
+struct hello_job {
+    struct dma_fence base;
+    spinlock_t lock;
+    /* on a hello_queue until a worker picks it up */
+    struct list_head node;
+    struct hello_file *hfile;
+    struct hello_buf *buf;
+    u64 offset;
+    u64 length;
+    /* fences from the buffer's reservation object still to signal, +1 */
+    atomic_t pending;
+    struct hello_job_dep *deps;
+    unsigned int nr_deps;
+    int dep_error;
+};
+
+struct hello_job_dep {
+    struct dma_fence_cb cb;
+    struct hello_job *job;
+    struct dma_fence *fence;
+};
+
+#define to_hello_job(f) container_of(f, struct hello_job, base)
+
+static struct workqueue_struct *hello_wq;
+
+/*
+ * Async submissions go to a queue of the submitting cpu and are run by
+ * that cpu's worker, so the buffer stays cache hot. A worker whose own
+ * queue is empty steals from the others, and a queue deeper than
+ * steal_depth kicks an idle cpu to come and help.
+ */
+struct hello_queue {
+    spinlock_t lock;
+    struct list_head jobs;
+    unsigned int depth;
+    int cpu;
+    struct work_struct work;
+    /* only for the debugfs "queues" file, racy reads are fine */
+    unsigned int max_depth;
+    u64 queued;
+    u64 executed;
+    u64 stolen;
+};
+
+static struct hello_queue __percpu *hello_queues;
+static struct workqueue_struct *hello_sq_wq;
+
+static unsigned int steal_depth = 4;
+module_param(steal_depth, uint, 0644);
+MODULE_PARM_DESC(steal_depth, "Queue depth above which an idle cpu is woken to steal jobs");
+
+/*
+ * Per-phase latency accounting. Counters are per cpu and only ever
+ * touched with this_cpu ops, the debugfs reader sums them up.
+ */
+enum hello_phase {
+    HELLO_PHASE_GET,
+    HELLO_PHASE_ATTACH,
+    HELLO_PHASE_MAP,
+    HELLO_PHASE_VMAP,
+    HELLO_PHASE_CPU,
+    HELLO_PHASE_UNMAP,
+    HELLO_PHASE_PUT,
+    HELLO_NR_PHASES,
+};
+
+static const char * const hello_phase_names[HELLO_NR_PHASES] = {
+    "get", "attach", "map", "vmap", "cpu", "unmap", "put",
+};
+
+/* bucket n counts latencies in [2^(n-1), 2^n) ns, the last one is open */
+#define HELLO_HIST_BUCKETS  32
+
+struct hello_stats {
+    u64 count[HELLO_NR_PHASES];
+    u64 total_ns[HELLO_NR_PHASES];
+    u64 hist[HELLO_NR_PHASES][HELLO_HIST_BUCKETS];
+    /* mappings that went through swiotlb, see hello_sgt_bounced() */
+    u64 bounced;
+    u64 bounced_bytes;
+    /* mappings dropped because the exporter moved the buffer */
+    u64 moved;
+};
+
+static struct dentry *hello_debugfs_root;
+
+static void hello_stats_add(struct dma_buf_dev *hdev, enum hello_phase phase,
+                            u64 start_ns)
+{
+    u64 ns = ktime_get_ns() - start_ns;
+    unsigned int bucket = min_t(unsigned int, fls64(ns), HELLO_HIST_BUCKETS - 1);
+
+    this_cpu_inc(hdev->stats->count[phase]);
+    this_cpu_add(hdev->stats->total_ns[phase], ns);
+    this_cpu_inc(hdev->stats->hist[phase][bucket]);
+}
+
+/*
+ * Without an iommu the dma address of a segment is its physical address
+ * as seen by the device, unless swiotlb bounced it because the pages sit
+ * above the dma mask. Returns the number of bytes that were bounced.
+ */
+static u64 hello_sgt_bounced(struct device *dev, struct sg_table *sgt)
+{
+    struct scatterlist *sg;
+    u64 bytes = 0;
+    int i;
+
+    if (device_iommu_mapped(dev))
+        return 0;
+
+    for_each_sgtable_sg(sgt, sg, i) {
+        if (sg_page(sg) && sg_dma_address(sg) != phys_to_dma(dev, sg_phys(sg)))
+            bytes += sg_dma_len(sg);
+    }
+    return bytes;
+}
+
+/* importers only get pages from exporters that have them */
+static bool hello_sgt_has_pages(struct sg_table *sgt)
+{
+    struct scatterlist *sg;
+    int i;
+
+    for_each_sgtable_sg(sgt, sg, i) {
+        if (!sg_page(sg))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Sync only the entries overlapping [offset, offset + len). dir has to be
+ * the one sgt was mapped with. Once the IOMMU has merged entries a dma
+ * segment no longer covers one physically contiguous run, so syncing part
+ * of it would hit the wrong pages: sync the whole table then.
+ */
+static void hello_sgt_sync_range(struct device *dev, struct sg_table *sgt,
+                                 enum dma_data_direction dir,
+                                 u64 offset, u64 len, bool for_cpu)
+{
+    struct scatterlist *sg;
+    u64 pos = 0, end = offset + len;
+    u64 start, stop;
+    int i;
+
+    if (sgt->nents != sgt->orig_nents) {
+        if (for_cpu)
+            dma_sync_sgtable_for_cpu(dev, sgt, dir);
+        else
+            dma_sync_sgtable_for_device(dev, sgt, dir);
+        return;
+    }
+
+    /* unmerged, so every cpu entry has its own dma address */
+    for_each_sgtable_sg(sgt, sg, i) {
+        if (pos >= end)
+            break;
+        start = max_t(u64, pos, offset);
+        stop = min_t(u64, pos + sg->length, end);
+        if (start < stop) {
+            if (for_cpu)
+                dma_sync_single_for_cpu(dev, sg_dma_address(sg) + (start - pos),
+                                        stop - start, dir);
+            else
+                dma_sync_single_for_device(dev, sg_dma_address(sg) + (start - pos),
+                                           stop - start, dir);
+        }
+        pos += sg->length;
+    }
+}
+
+/* map for the device if there is no valid mapping, reservation lock held */
+static struct sg_table *hello_buf_map_locked(struct hello_buf *buf)
+{
+    struct dma_buf_dev *hdev = buf->hdev;
+    struct sg_table *sg;
+    u64 start;
+
+    dma_resv_assert_held(buf->dma_buf->resv);
+
+    if (buf->sg)
+        return buf->sg;
+
+    start = ktime_get_ns();
+    sg = dma_buf_map_attachment(buf->attach, buf->dir);
+    if (IS_ERR_OR_NULL(sg)) {
+        pr_info("Error! failed to map attached dma buf");
+        return sg ? sg : ERR_PTR(-ENOMEM);
+    }
+    hello_stats_add(hdev, HELLO_PHASE_MAP, start);
+    trace_hello_dma_buf_map(buf->dma_buf, sg, buf->dir);
+    dev_dbg(hdev->dev, "mapped nents = %u, orig_nents = %u\n",
+            sg->nents, sg->orig_nents);
+
+    buf->bounced = hello_sgt_bounced(hdev->dev, sg);
+    if (buf->bounced) {
+        this_cpu_inc(hdev->stats->bounced);
+        this_cpu_add(hdev->stats->bounced_bytes, buf->bounced);
+        dev_warn_ratelimited(hdev->dev, "%llu bytes bounced through swiotlb\n",
+                             buf->bounced);
+    }
+
+    buf->sg = sg;
+    return sg;
+}
+
+/*
+ * The exporter is about to move the buffer, called with the reservation
+ * lock held. Nothing of ours is in flight on the old mappings, users pin
+ * it first, so just drop them and let the next user map again. The vmap
+ * can't be torn down under the reservation lock, it is only marked stale.
+ */
+static void hello_buf_move_notify(struct dma_buf_attachment *attach)
+{
+    struct hello_buf *buf = attach->importer_priv;
+
+    buf->vaddr_stale = true;
+    if (!buf->sg)
+        return;
+
+    dma_buf_unmap_attachment(attach, buf->sg, buf->dir);
+    buf->sg = NULL;
+    this_cpu_inc(buf->hdev->stats->moved);
+}
+
+static const struct dma_buf_attach_ops hello_importer_ops = {
+    .move_notify = hello_buf_move_notify,
+};
+
+/*
+ * A mapping that stays valid until hello_buf_unpin_sgt(). The pin only
+ * lasts for one operation, in between the exporter is free to move the
+ * buffer. Static attachments never move, they have nothing to pin.
+ */
+static struct sg_table *hello_buf_pin_sgt(struct hello_buf *buf)
+{
+    bool dynamic = dma_buf_attachment_is_dynamic(buf->attach);
+    struct sg_table *sg;
+    int ret;
+
+    dma_resv_lock(buf->dma_buf->resv, NULL);
+    if (dynamic) {
+        ret = dma_buf_pin(buf->attach);
+        if (ret) {
+            sg = ERR_PTR(ret);
+            goto out;
+        }
+    }
+    sg = hello_buf_map_locked(buf);
+    if (IS_ERR(sg) && dynamic)
+        dma_buf_unpin(buf->attach);
+out:
+    dma_resv_unlock(buf->dma_buf->resv);
+    return sg;
+}
+
+static void hello_buf_unpin_sgt(struct hello_buf *buf)
+{
+    if (!dma_buf_attachment_is_dynamic(buf->attach))
+        return;
+
+    dma_resv_lock(buf->dma_buf->resv, NULL);
+    dma_buf_unpin(buf->attach);
+    dma_resv_unlock(buf->dma_buf->resv);
+}
+
+/*
+ * Attach and map a dma-buf, the reference to it moves to the hello_buf.
+ * With exporters that can move buffers the attachment is dynamic, so they
+ * don't have to keep this one pinned while we hold it. Everything else
+ * gets a static one: a dynamic importer of a static exporter is mapped
+ * bidirectionally at attach time, whatever dir says.
+ */
+static struct hello_buf *hello_buf_attach(struct dma_buf_dev *hdev,
+                                          struct dma_buf *dmabuf,
+                                          enum dma_data_direction dir)
+{
+    struct hello_buf *buf;
+    struct sg_table *sg;
+    u64 start;
+    int ret;
+
+    buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto err_put;
+    }
+
+    kref_init(&buf->ref);
+    mutex_init(&buf->lock);
+    buf->hdev = hdev;
+    buf->dir = dir;
+    buf->dma_buf = dmabuf;
+
+    start = ktime_get_ns();
+    if (dma_buf_is_dynamic(buf->dma_buf))
+        buf->attach = dma_buf_dynamic_attach(buf->dma_buf, hdev->dev,
+                                             &hello_importer_ops, buf);
+    else
+        buf->attach = dma_buf_attach(buf->dma_buf, hdev->dev);
+    if (IS_ERR(buf->attach)) {
+        pr_info("Error! failed to attach dma buf");
+        ret = PTR_ERR(buf->attach);
+        goto err_free;
+    }
+    hello_stats_add(hdev, HELLO_PHASE_ATTACH, start);
+    trace_hello_dma_buf_attach(buf->dma_buf);
+
+    /* map once up front so a buffer the device can't use fails the import */
+    dma_resv_lock(buf->dma_buf->resv, NULL);
+    sg = hello_buf_map_locked(buf);
+    dma_resv_unlock(buf->dma_buf->resv);
+    if (IS_ERR(sg)) {
+        ret = PTR_ERR(sg);
+        goto err_detach;
+    }
+
+    return buf;
+
+err_detach:
+    dma_buf_detach(buf->dma_buf, buf->attach);
+err_free:
+    kfree(buf);
+err_put:
+    dma_buf_put(dmabuf);
+    return ERR_PTR(ret);
+}
+
+static struct hello_buf *hello_buf_import(struct dma_buf_dev *hdev, int fd,
+                                          enum dma_data_direction dir)
+{
+    struct dma_buf *dmabuf;
+    u64 start;
+
+    start = ktime_get_ns();
+    dmabuf = dma_buf_get(fd);
+    if (IS_ERR(dmabuf)) {
+        pr_info("Error! failed to get dma buf");
+        return ERR_CAST(dmabuf);
+    }
+    hello_stats_add(hdev, HELLO_PHASE_GET, start);
+    trace_hello_dma_buf_get(dmabuf);
+
+    return hello_buf_attach(hdev, dmabuf, dir);
+}
+
+static void hello_buf_free(struct kref *ref)
+{
+    struct hello_buf *buf = container_of(ref, struct hello_buf, ref);
+    u64 start;
+
+    start = ktime_get_ns();
+    if (buf->vaddr)
+        dma_buf_vunmap(buf->dma_buf, buf->vaddr);
+    dma_resv_lock(buf->dma_buf->resv, NULL);
+    if (buf->sg)
+        dma_buf_unmap_attachment(buf->attach, buf->sg, buf->dir);
+    dma_resv_unlock(buf->dma_buf->resv);
+    dma_buf_detach(buf->dma_buf, buf->attach);
+    hello_stats_add(buf->hdev, HELLO_PHASE_UNMAP, start);
+    trace_hello_dma_buf_unmap(buf->dma_buf);
+
+    trace_hello_dma_buf_put(buf->dma_buf);
+    start = ktime_get_ns();
+    dma_buf_put(buf->dma_buf);
+    hello_stats_add(buf->hdev, HELLO_PHASE_PUT, start);
+
+    kfree(buf);
+}
+
+static void hello_buf_put(struct hello_buf *buf)
+{
+    kref_put(&buf->ref, hello_buf_free);
+}
+
+/*
+ * Left in place of a userptr handle whose range was unmapped or changed,
+ * so the handle fails until released instead of being reused.
+ */
+#define HELLO_HANDLE_REVOKED    xa_mk_value(0)
+
+static struct hello_buf *hello_buf_lookup(struct hello_file *hfile, u32 handle)
+{
+    struct hello_buf *buf;
+
+    xa_lock(&hfile->bufs);
+    buf = xa_load(&hfile->bufs, handle);
+    if (xa_is_value(buf))
+        buf = NULL;
+    if (buf)
+        kref_get(&buf->ref);
+    xa_unlock(&hfile->bufs);
+
+    return buf;
+}
+
+static void hello_bufs_release_all(struct hello_file *hfile)
+{
+    struct hello_buf *buf;
+    unsigned long handle;
+
+    xa_for_each(&hfile->bufs, handle, buf) {
+        xa_erase(&hfile->bufs, handle);
+        if (!xa_is_value(buf))
+            hello_buf_put(buf);
+    }
+    xa_destroy(&hfile->bufs);
+}
+
+static int hello_dir_from_user(struct dma_buf_dev *hdev, u32 dir,
+                               enum dma_data_direction *out)
+{
+    switch (dir) {
+    case HELLO_DIR_DEFAULT:
+        *out = hdev->dir;
+        return 0;
+    case HELLO_DIR_TO_DEVICE:
+        *out = DMA_TO_DEVICE;
+        return 0;
+    case HELLO_DIR_FROM_DEVICE:
+        *out = DMA_FROM_DEVICE;
+        return 0;
+    case HELLO_DIR_BIDIRECTIONAL:
+        *out = DMA_BIDIRECTIONAL;
+        return 0;
+    }
+    return -EINVAL;
+}
+
+/*
+ * A cpu write is only seen by the device if the mapping cleans the cache
+ * for it, a FROM_DEVICE mapping may just invalidate and lose it.
+ */
+static int hello_buf_check_write(struct hello_buf *buf)
+{
+    if (buf->dir != DMA_TO_DEVICE && buf->dir != DMA_BIDIRECTIONAL)
+        return -EINVAL;
+    return 0;
+}
+
+static long hello_ioctl_import(struct hello_file *hfile, unsigned long arg)
+{
+    struct hello_import req;
+    struct hello_buf *buf;
+    enum dma_data_direction dir;
+    u32 handle;
+    int ret;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)) != 0)
+        return -EFAULT;
+
+    ret = hello_dir_from_user(hfile->hdev, req.dir, &dir);
+    if (ret)
+        return ret;
+
+    buf = hello_buf_import(hfile->hdev, req.fd, dir);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+
+    ret = xa_alloc(&hfile->bufs, &handle, buf, xa_limit_32b, GFP_KERNEL);
+    if (ret < 0) {
+        hello_buf_put(buf);
+        return ret;
+    }
+
+    req.handle = handle;
+    req.size = buf->dma_buf->size;
+    if (copy_to_user((void __user *)arg, &req, sizeof(req)) != 0) {
+        buf = xa_erase(&hfile->bufs, handle);
+        if (buf)
+            hello_buf_put(buf);
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+static long hello_ioctl_release(struct hello_file *hfile, unsigned long arg)
+{
+    struct hello_buf *buf;
+    u32 handle;
+
+    if (get_user(handle, (u32 __user *)arg))
+        return -EFAULT;
+
+    buf = xa_erase(&hfile->bufs, handle);
+    if (!buf)
+        return -EINVAL;
+
+    if (!xa_is_value(buf))
+        hello_buf_put(buf);
+    return 0;
+}
+
+/*
+ * Kernel address of the whole buffer. The vmap is built once and cached
+ * for the lifetime of the import, so repeated cpu access costs nothing
+ * extra to map; callers still bracket the access with begin/end_cpu_access.
+ * Callers hold hello_buf_pin_sgt() across the access, so the buffer can't
+ * move under the mapping, and a mapping a move left stale is redone here.
+ */
+static void *hello_buf_vaddr(struct hello_buf *buf)
+{
+    void *vaddr;
+    u64 start;
+
+    mutex_lock(&buf->lock);
+    if (buf->vaddr && buf->vaddr_stale) {
+        dma_buf_vunmap(buf->dma_buf, buf->vaddr);
+        buf->vaddr = NULL;
+    }
+    buf->vaddr_stale = false;
+    if (!buf->vaddr) {
+        start = ktime_get_ns();
+        buf->vaddr = dma_buf_vmap(buf->dma_buf);
+        if (buf->vaddr) {
+            hello_stats_add(buf->hdev, HELLO_PHASE_VMAP, start);
+            trace_hello_dma_buf_vmap(buf->dma_buf);
+        }
+    }
+    vaddr = buf->vaddr;
+    mutex_unlock(&buf->lock);
+
+    return vaddr;
+}
+
+/* validate [offset, offset + *length), a zero length means "to the end" */
+static int hello_buf_check_range(struct hello_buf *buf, u64 offset, u64 *length)
+{
+    size_t size = buf->dma_buf->size;
+
+    if (offset >= size)
+        return -EINVAL;
+    if (!*length)
+        *length = size - offset;
+    if (*length > size - offset)
+        return -EINVAL;
+
+    return 0;
+}
+
+/*
+ * Cache maintenance limited to the range the cpu actually touches, where
+ * both the kernel and the exporter support it. Everything else syncs the
+ * whole buffer.
+ */
+static int hello_buf_begin_cpu(struct hello_buf *buf, enum dma_data_direction dir,
+                               u64 offset, u64 length)
+{
+    trace_hello_dma_buf_cpu_access(buf->dma_buf, offset, length, dir);
+
+#ifdef CONFIG_MY_TEST_DMA_BUF_PARTIAL
+    if (buf->dma_buf->ops->begin_cpu_access_partial && offset + length <= U32_MAX)
+        return dma_buf_begin_cpu_access_partial(buf->dma_buf, dir, offset, length);
+#endif
+    return dma_buf_begin_cpu_access(buf->dma_buf, dir);
+}
+
+static void hello_buf_end_cpu(struct hello_buf *buf, enum dma_data_direction dir,
+                              u64 offset, u64 length)
+{
+#ifdef CONFIG_MY_TEST_DMA_BUF_PARTIAL
+    if (buf->dma_buf->ops->end_cpu_access_partial && offset + length <= U32_MAX) {
+        dma_buf_end_cpu_access_partial(buf->dma_buf, dir, offset, length);
+        return;
+    }
+#endif
+    dma_buf_end_cpu_access(buf->dma_buf, dir);
+}
+
+/*
+ * The cpu side of a submission, the dma mapping is already in place.
+ * Writes the device string into the checked range, truncated to fit.
+ */
+static int hello_buf_process(struct hello_buf *buf, u64 offset, u64 length)
+{
+    const char *str = buf->hdev->str;
+    size_t len = min_t(u64, strlen(str) + 1, length);
+    struct sg_table *sgt;
+    void *vaddr;
+    u64 start;
+    int ret;
+
+    ret = hello_buf_check_write(buf);
+    if (ret)
+        return ret;
+
+    sgt = hello_buf_pin_sgt(buf);
+    if (IS_ERR(sgt))
+        return PTR_ERR(sgt);
+
+    vaddr = hello_buf_vaddr(buf);
+    if (!vaddr) {
+        ret = -ENOMEM;
+        goto unpin;
+    }
+
+    start = ktime_get_ns();
+    ret = hello_buf_begin_cpu(buf, DMA_TO_DEVICE, offset, len);
+    if (ret)
+        goto unpin;
+    memcpy((char *)vaddr + offset, str, len);
+    hello_buf_end_cpu(buf, DMA_TO_DEVICE, offset, len);
+    hello_stats_add(buf->hdev, HELLO_PHASE_CPU, start);
+
+unpin:
+    hello_buf_unpin_sgt(buf);
+    return ret;
+}
+
+/*
+ * The device side of an async job. Its own fence is already in the
+ * reservation object, and begin_cpu_access would wait for that, so the
+ * job syncs its dma mapping itself like a bus master writing the buffer.
+ */
+static int hello_buf_process_dev(struct hello_buf *buf, u64 offset, u64 length)
+{
+    struct device *dev = buf->hdev->dev;
+    const char *str = buf->hdev->str;
+    size_t len = min_t(u64, strlen(str) + 1, length);
+    struct sg_table *sgt;
+    void *vaddr;
+    u64 start;
+    int ret = 0;
+
+    sgt = hello_buf_pin_sgt(buf);
+    if (IS_ERR(sgt))
+        return PTR_ERR(sgt);
+    if (!hello_sgt_has_pages(sgt)) {
+        ret = -EOPNOTSUPP;
+        goto unpin;
+    }
+
+    vaddr = hello_buf_vaddr(buf);
+    if (!vaddr) {
+        ret = -ENOMEM;
+        goto unpin;
+    }
+
+    start = ktime_get_ns();
+    trace_hello_dma_buf_cpu_access(buf->dma_buf, offset, len, buf->dir);
+    hello_sgt_sync_range(dev, sgt, buf->dir, offset, len, true);
+    memcpy((char *)vaddr + offset, str, len);
+    flush_kernel_vmap_range((char *)vaddr + offset, len);
+    hello_sgt_sync_range(dev, sgt, buf->dir, offset, len, false);
+    hello_stats_add(buf->hdev, HELLO_PHASE_CPU, start);
+
+unpin:
+    hello_buf_unpin_sgt(buf);
+    return ret;
+}
+
+static void hello_file_free(struct kref *ref)
+{
+    struct hello_file *hfile = container_of(ref, struct hello_file, ref);
+
+    kfree(hfile);
+}
+
+static void hello_file_put(struct hello_file *hfile)
+{
+    kref_put(&hfile->ref, hello_file_free);
+}
+
+static const char *hello_fence_get_driver_name(struct dma_fence *fence)
+{
+    return "hello";
+}
+
+static const char *hello_fence_get_timeline_name(struct dma_fence *fence)
+{
+    return "hello_submit";
+}
+
+static void hello_fence_release(struct dma_fence *fence)
+{
+    struct hello_job *job = to_hello_job(fence);
+
+    kfree(job->deps);
+    kfree_rcu(job, base.rcu);
+    module_put(THIS_MODULE);
+}
+
+static const struct dma_fence_ops hello_fence_ops = {
+    .get_driver_name = hello_fence_get_driver_name,
+    .get_timeline_name = hello_fence_get_timeline_name,
+    .release = hello_fence_release,
+};
+
+static void hello_job_run(struct hello_job *job)
+{
+    struct hello_file *hfile = job->hfile;
+    unsigned int i;
+    int ret;
+
+    ret = READ_ONCE(job->dep_error);
+    if (!ret)
+        ret = hello_buf_process_dev(job->buf, job->offset, job->length);
+    if (ret)
+        dma_fence_set_error(&job->base, ret);
+    dma_fence_signal(&job->base);
+
+    for (i = 0; i < job->nr_deps; i++)
+        dma_fence_put(job->deps[i].fence);
+
+    hello_buf_put(job->buf);
+    dma_fence_put(&job->base);
+
+    atomic_dec(&hfile->inflight);
+    wake_up_interruptible(&hfile->wait);
+    hello_file_put(hfile);
+}
+
+/* the owner takes the oldest job, thieves take the newest */
+static struct hello_job *hello_queue_pop(struct hello_queue *q, bool steal)
+{
+    struct hello_job *job = NULL;
+    unsigned long flags;
+
+    if (!READ_ONCE(q->depth))
+        return NULL;
+
+    spin_lock_irqsave(&q->lock, flags);
+    if (!list_empty(&q->jobs)) {
+        if (steal)
+            job = list_last_entry(&q->jobs, struct hello_job, node);
+        else
+            job = list_first_entry(&q->jobs, struct hello_job, node);
+        list_del(&job->node);
+        q->depth--;
+    }
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    return job;
+}
+
+static struct hello_job *hello_queue_steal(struct hello_queue *self)
+{
+    struct hello_job *job;
+    unsigned int i;
+    int cpu;
+
+    for (i = 1; i < nr_cpu_ids; i++) {
+        cpu = (self->cpu + i) % nr_cpu_ids;
+        if (!cpu_possible(cpu))
+            continue;
+        job = hello_queue_pop(per_cpu_ptr(hello_queues, cpu), true);
+        if (job)
+            return job;
+    }
+    return NULL;
+}
+
+static void hello_queue_work(struct work_struct *work)
+{
+    struct hello_queue *q = container_of(work, struct hello_queue, work);
+    struct hello_job *job;
+
+    for (;;) {
+        job = hello_queue_pop(q, false);
+        if (!job) {
+            job = hello_queue_steal(q);
+            if (!job)
+                break;
+            q->stolen++;
+        }
+        q->executed++;
+        hello_job_run(job);
+        cond_resched();
+    }
+}
+
+/* wake the first cpu with nothing queued, its worker will steal */
+static void hello_queue_kick_idle(struct hello_queue *busy)
+{
+    struct hello_queue *q;
+    unsigned int i;
+    int cpu;
+
+    for (i = 1; i < nr_cpu_ids; i++) {
+        cpu = (busy->cpu + i) % nr_cpu_ids;
+        if (!cpu_online(cpu))
+            continue;
+        q = per_cpu_ptr(hello_queues, cpu);
+        if (!READ_ONCE(q->depth) && queue_work_on(cpu, hello_sq_wq, &q->work))
+            return;
+    }
+}
+
+/* also called from fence callbacks, so the queue lock is irq safe */
+static void hello_queue_job(struct hello_job *job)
+{
+    struct hello_queue *q;
+    unsigned int depth;
+    unsigned long flags;
+
+    q = get_cpu_ptr(hello_queues);
+    spin_lock_irqsave(&q->lock, flags);
+    list_add_tail(&job->node, &q->jobs);
+    depth = ++q->depth;
+    q->queued++;
+    q->max_depth = max(q->max_depth, depth);
+    spin_unlock_irqrestore(&q->lock, flags);
+    put_cpu_ptr(hello_queues);
+
+    queue_work_on(q->cpu, hello_sq_wq, &q->work);
+    if (depth > READ_ONCE(steal_depth))
+        hello_queue_kick_idle(q);
+}
+
+static void hello_job_dep_cb(struct dma_fence *fence, struct dma_fence_cb *cb)
+{
+    struct hello_job_dep *dep = container_of(cb, struct hello_job_dep, cb);
+    struct hello_job *job = dep->job;
+
+    if (fence->error)
+        WRITE_ONCE(job->dep_error, fence->error);
+    if (atomic_dec_and_test(&job->pending))
+        hello_queue_job(job);
+}
+
+static void hello_job_add_dep(struct hello_job *job, struct dma_fence *fence)
+{
+    struct hello_job_dep *dep = &job->deps[job->nr_deps++];
+
+    dep->job = job;
+    dep->fence = dma_fence_get(fence);
+    atomic_inc(&job->pending);
+    if (dma_fence_add_callback(fence, &dep->cb, hello_job_dep_cb)) {
+        /* already signalled */
+        if (fence->error)
+            WRITE_ONCE(job->dep_error, fence->error);
+        atomic_dec(&job->pending);
+    }
+}
+
+/*
+ * Implicit sync. The job writes the buffer, so it waits for every fence
+ * in the reservation object, through callbacks so nobody blocks, and its
+ * own fence becomes the exclusive one that later users wait for.
+ */
+static int hello_job_sync_resv(struct hello_job *job)
+{
+    struct dma_resv *resv = job->buf->dma_buf->resv;
+    struct dma_resv_list *list;
+    struct dma_fence *fence;
+    unsigned int count, i;
+    int ret = 0;
+
+    dma_resv_lock(resv, NULL);
+
+    list = dma_resv_get_list(resv);
+    count = list ? list->shared_count : 0;
+    job->deps = kcalloc(count + 1, sizeof(*job->deps), GFP_KERNEL);
+    if (!job->deps) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    fence = dma_resv_get_excl(resv);
+    if (fence)
+        hello_job_add_dep(job, fence);
+    for (i = 0; i < count; i++) {
+        fence = rcu_dereference_protected(list->shared[i], dma_resv_held(resv));
+        hello_job_add_dep(job, fence);
+    }
+
+    dma_resv_add_excl_fence(resv, &job->base);
+out:
+    dma_resv_unlock(resv);
+    return ret;
+}
+
+/*
+ * Queue the work and hand a sync_file back to userspace. On success the
+ * job owns the buf reference, on failure the caller still does.
+ */
+static int hello_submit_async(struct hello_file *hfile, struct hello_buf *buf,
+                              struct hello_submit *req, unsigned long arg)
+{
+    struct hello_job *job;
+    struct sync_file *sync;
+    int fd, ret;
+
+    ret = hello_buf_check_write(buf);
+    if (ret)
+        return ret;
+
+    if (atomic_inc_return(&hfile->inflight) > HELLO_MAX_INFLIGHT) {
+        ret = -EAGAIN;
+        goto err_dec;
+    }
+
+    job = kzalloc(sizeof(*job), GFP_KERNEL);
+    if (!job) {
+        ret = -ENOMEM;
+        goto err_dec;
+    }
+
+    spin_lock_init(&job->lock);
+    /*
+     * The fence may outlive the file, and dependency callbacks point into
+     * this module, so hold it until the fence is released.
+     */
+    __module_get(THIS_MODULE);
+    /* jobs may finish out of order, so each one is its own timeline */
+    dma_fence_init(&job->base, &hello_fence_ops, &job->lock,
+                   dma_fence_context_alloc(1), 1);
+
+    sync = sync_file_create(&job->base);
+    if (!sync) {
+        ret = -ENOMEM;
+        goto err_fence;
+    }
+
+    fd = get_unused_fd_flags(O_CLOEXEC);
+    if (fd < 0) {
+        ret = fd;
+        goto err_sync;
+    }
+
+    req->fence_fd = fd;
+    if (copy_to_user((void __user *)arg, req, sizeof(*req)) != 0) {
+        ret = -EFAULT;
+        goto err_fd;
+    }
+
+    fd_install(fd, sync->file);
+
+    kref_get(&hfile->ref);
+    job->hfile = hfile;
+    job->buf = buf;
+    job->offset = req->offset;
+    job->length = req->length;
+
+    /* the fence is out now, failing from here on only fails the job */
+    atomic_set(&job->pending, 1);
+    ret = hello_job_sync_resv(job);
+    if (ret)
+        job->dep_error = ret;
+    if (atomic_dec_and_test(&job->pending))
+        hello_queue_job(job);
+
+    return 0;
+
+err_fd:
+    put_unused_fd(fd);
+err_sync:
+    fput(sync->file);
+err_fence:
+    dma_fence_set_error(&job->base, ret);
+    dma_fence_signal(&job->base);
+    dma_fence_put(&job->base);
+err_dec:
+    atomic_dec(&hfile->inflight);
+    return ret;
+}
+
+static long hello_ioctl_submit(struct hello_file *hfile, unsigned long arg)
+{
+    struct hello_submit req;
+    struct hello_buf *buf;
+    long ret;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)) != 0)
+        return -EFAULT;
+    if (req.flags & ~HELLO_SUBMIT_ASYNC)
+        return -EINVAL;
+
+    buf = hello_buf_lookup(hfile, req.handle);
+    if (!buf)
+        return -EINVAL;
+
+    ret = hello_buf_check_range(buf, req.offset, &req.length);
+    if (ret)
+        goto out;
+
+    if (req.flags & HELLO_SUBMIT_ASYNC) {
+        ret = hello_submit_async(hfile, buf, &req, arg);
+        if (!ret)
+            return 0;
+        goto out;
+    }
+
+    ret = hello_buf_process(buf, req.offset, req.length);
+out:
+    hello_buf_put(buf);
+    return ret;
+}
+
+/*
+ * A handle of this file, or a dma-buf fd imported just for the caller
+ * and mapped with dir. Handles keep the direction they were imported with.
+ */
+static struct hello_buf *hello_buf_get(struct hello_file *hfile, u32 handle, int fd,
+                                       enum dma_data_direction dir)
+{
+    struct hello_buf *buf;
+
+    if (!handle)
+        return hello_buf_import(hfile->hdev, fd, dir);
+
+    buf = hello_buf_lookup(hfile, handle);
+    return buf ? buf : ERR_PTR(-EINVAL);
+}
+
+static int hello_batch_entry_process(struct hello_file *hfile,
+                                     struct hello_batch_entry *entry)
+{
+    struct hello_buf *buf;
+    enum dma_data_direction dir;
+    int ret;
+
+    if (entry->handle && entry->dir)
+        return -EINVAL;
+    ret = hello_dir_from_user(hfile->hdev, entry->dir, &dir);
+    if (ret)
+        return ret;
+
+    buf = hello_buf_get(hfile, entry->handle, entry->fd, dir);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+
+    ret = hello_buf_check_range(buf, entry->offset, &entry->length);
+    if (!ret)
+        ret = hello_buf_process(buf, entry->offset, entry->length);
+    hello_buf_put(buf);
+    return ret;
+}
+
+/*
+ * Process a whole array of descriptors with one syscall. The array is
+ * copied in and out once, failures are reported per entry and don't stop
+ * the rest of the batch.
+ */
+static long hello_ioctl_batch(struct hello_file *hfile, unsigned long arg)
+{
+    struct hello_batch req;
+    struct hello_batch_entry *entries;
+    void __user *uentries;
+    size_t size;
+    u32 i;
+    long ret = 0;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)) != 0)
+        return -EFAULT;
+    if (req.flags || !req.count || req.count > HELLO_BATCH_MAX)
+        return -EINVAL;
+
+    uentries = u64_to_user_ptr(req.entries);
+    size = array_size(req.count, sizeof(*entries));
+    entries = memdup_user(uentries, size);
+    if (IS_ERR(entries))
+        return PTR_ERR(entries);
+
+    for (i = 0; i < req.count; i++)
+        entries[i].status = hello_batch_entry_process(hfile, &entries[i]);
+
+    if (copy_to_user(uentries, entries, size) != 0)
+        ret = -EFAULT;
+
+    kfree(entries);
+    return ret;
+}
+
+/*
+ * Splitting large cpu operations. A request longer than par_min_kb is cut
+ * into up to par_threads page aligned chunks, all but the first go to an
+ * unbound workqueue and the caller runs the first one itself before it
+ * waits for the rest. Setup that must happen once per buffer, pinning
+ * the sg_table and cache maintenance, stays with the caller.
+ */
+#define HELLO_PAR_MAX   64
+
+static unsigned int par_threads;
+module_param(par_threads, uint, 0644);
+MODULE_PARM_DESC(par_threads, "Chunks a large copy/fill/checksum is split into, 0 = online cpus");
+
+static unsigned int par_min_kb = 1024;
+module_param(par_min_kb, uint, 0644);
+MODULE_PARM_DESC(par_min_kb, "Smallest chunk in KiB worth handing to another cpu");
+
+static struct workqueue_struct *hello_par_wq;
+
+struct hello_par;
+
+struct hello_par_chunk {
+    struct work_struct work;
+    struct hello_par *par;
+    /* relative to the start of the request */
+    u64 start;
+    u64 len;
+    /* per operation, e.g. the chunk's crc */
+    u64 result;
+    int ret;
+};
+
+struct hello_par {
+    int (*fn)(struct hello_par *par, struct hello_par_chunk *pc);
+    void *priv;
+    struct hello_par_chunk *chunks;
+    unsigned int nr;
+    atomic_t pending;
+    struct completion done;
+    /* requests that aren't split don't allocate */
+    struct hello_par_chunk single;
+};
+
+static void hello_par_exec(struct hello_par_chunk *pc)
+{
+    struct hello_par *par = pc->par;
+
+    pc->ret = par->fn(par, pc);
+    if (atomic_dec_and_test(&par->pending))
+        complete(&par->done);
+}
+
+static void hello_par_work(struct work_struct *work)
+{
+    hello_par_exec(container_of(work, struct hello_par_chunk, work));
+}
+
+/*
+ * Runs par->fn over [0, length) and returns the error of the first chunk
+ * that failed, in buffer order, which is what a serial run would have
+ * hit. Per chunk results stay in par->chunks until hello_par_free().
+ */
+static int hello_par_run(struct hello_par *par, u64 length)
+{
+    unsigned int max = READ_ONCE(par_threads) ? : num_online_cpus();
+    u64 min_chunk = max_t(u64, (u64)READ_ONCE(par_min_kb) << 10, PAGE_SIZE);
+    struct hello_par_chunk *pc;
+    u64 chunk = length;
+    unsigned int i, nr;
+
+    max = clamp(max, 1U, (unsigned int)HELLO_PAR_MAX);
+    nr = min_t(u64, max, div64_u64(length, min_chunk));
+    par->chunks = NULL;
+    if (nr > 1) {
+        chunk = round_up(div64_u64(length + nr - 1, nr), PAGE_SIZE);
+        nr = div64_u64(length + chunk - 1, chunk);
+        par->chunks = kcalloc(nr, sizeof(*par->chunks), GFP_KERNEL);
+    }
+    if (!par->chunks) {
+        /* too small to split, or no memory to do it: run it here */
+        nr = 1;
+        chunk = length;
+        par->chunks = &par->single;
+    }
+
+    par->nr = nr;
+    atomic_set(&par->pending, nr);
+    init_completion(&par->done);
+    for (i = 0; i < nr; i++) {
+        pc = &par->chunks[i];
+        pc->par = par;
+        pc->start = i * chunk;
+        pc->len = min(chunk, length - pc->start);
+        pc->ret = 0;
+    }
+
+    for (i = 1; i < nr; i++) {
+        INIT_WORK(&par->chunks[i].work, hello_par_work);
+        queue_work(hello_par_wq, &par->chunks[i].work);
+    }
+    hello_par_exec(&par->chunks[0]);
+    wait_for_completion(&par->done);
+
+    for (i = 0; i < nr; i++)
+        if (par->chunks[i].ret)
+            return par->chunks[i].ret;
+    return 0;
+}
+
+static void hello_par_free(struct hello_par *par)
+{
+    if (par->chunks != &par->single)
+        kfree(par->chunks);
+}
+
+/*
+ * Walks the cpu pages behind an sg_table starting at a byte offset, one
+ * kmapped chunk at a time. Nothing is vmapped, so it works on buffers of
+ * any size and on highmem.
+ */
+struct hello_sg_cursor {
+    struct sg_mapping_iter miter;
+    u64 skip;
+    void *addr;
+    size_t avail;
+};
+
+static void hello_cursor_start(struct hello_sg_cursor *c, struct sg_table *sgt,
+                               u64 offset, unsigned int flags)
+{
+    sg_miter_start(&c->miter, sgt->sgl, sgt->orig_nents, flags);
+    c->skip = offset;
+    c->addr = NULL;
+    c->avail = 0;
+}
+
+/* make sure at least one byte is mapped, false once the table ends */
+static bool hello_cursor_next(struct hello_sg_cursor *c)
+{
+    if (c->avail)
+        return true;
+
+    if (c->skip) {
+        if (!sg_miter_skip(&c->miter, c->skip))
+            return false;
+        c->skip = 0;
+    }
+    if (!sg_miter_next(&c->miter))
+        return false;
+
+    c->addr = c->miter.addr;
+    c->avail = c->miter.length;
+    return true;
+}
+
+static void hello_cursor_advance(struct hello_sg_cursor *c, size_t n)
+{
+    c->addr += n;
+    c->avail -= n;
+}
+
+static void hello_cursor_stop(struct hello_sg_cursor *c)
+{
+    sg_miter_stop(&c->miter);
+}
+
+/*
+ * Copy between two imported buffers straight through their sg_tables,
+ * no vmap and no bounce through userspace.
+ */
+struct hello_copy_ctx {
+    struct sg_table *dst_sgt;
+    struct sg_table *src_sgt;
+    u64 dst_off;
+    u64 src_off;
+};
+
+static int hello_copy_chunk(struct hello_par *par, struct hello_par_chunk *pc)
+{
+    struct hello_copy_ctx *x = par->priv;
+    struct hello_sg_cursor s, d;
+    u64 left = pc->len;
+    size_t chunk;
+    int ret = 0;
+
+    hello_cursor_start(&s, x->src_sgt, x->src_off + pc->start, SG_MITER_FROM_SG);
+    hello_cursor_start(&d, x->dst_sgt, x->dst_off + pc->start, SG_MITER_TO_SG);
+    while (left) {
+        if (!hello_cursor_next(&s) || !hello_cursor_next(&d)) {
+            ret = -EINVAL;
+            break;
+        }
+        chunk = min_t(u64, left, min(s.avail, d.avail));
+        memcpy(d.addr, s.addr, chunk);
+        hello_cursor_advance(&s, chunk);
+        hello_cursor_advance(&d, chunk);
+        left -= chunk;
+    }
+    hello_cursor_stop(&d);
+    hello_cursor_stop(&s);
+
+    return ret;
+}
+
+static int hello_copy_range(struct hello_buf *dst, u64 dst_off,
+                            struct hello_buf *src, u64 src_off, u64 length)
+{
+    struct hello_copy_ctx x = { .dst_off = dst_off, .src_off = src_off };
+    struct hello_par par = { .fn = hello_copy_chunk, .priv = &x };
+    u64 start = ktime_get_ns();
+    int ret;
+
+    ret = hello_buf_check_write(dst);
+    if (ret)
+        return ret;
+
+    x.src_sgt = hello_buf_pin_sgt(src);
+    if (IS_ERR(x.src_sgt))
+        return PTR_ERR(x.src_sgt);
+    x.dst_sgt = hello_buf_pin_sgt(dst);
+    if (IS_ERR(x.dst_sgt)) {
+        ret = PTR_ERR(x.dst_sgt);
+        goto unpin_src;
+    }
+
+    if (!hello_sgt_has_pages(x.src_sgt) || !hello_sgt_has_pages(x.dst_sgt)) {
+        ret = -EOPNOTSUPP;
+        goto unpin_dst;
+    }
+
+    ret = hello_buf_begin_cpu(src, DMA_FROM_DEVICE, src_off, length);
+    if (ret)
+        goto unpin_dst;
+    ret = hello_buf_begin_cpu(dst, DMA_TO_DEVICE, dst_off, length);
+    if (ret)
+        goto end_src;
+
+    ret = hello_par_run(&par, length);
+    hello_par_free(&par);
+
+    hello_buf_end_cpu(dst, DMA_TO_DEVICE, dst_off, length);
+end_src:
+    hello_buf_end_cpu(src, DMA_FROM_DEVICE, src_off, length);
+    if (!ret)
+        hello_stats_add(dst->hdev, HELLO_PHASE_CPU, start);
+unpin_dst:
+    hello_buf_unpin_sgt(dst);
+unpin_src:
+    hello_buf_unpin_sgt(src);
+    return ret;
+}
+
+/*
+ * Test patterns, defined per native endian 64-bit word at its position
+ * in the buffer: CONST repeats the seed, INC is seed + word index and
+ * PRNG is splitmix64 of the index. Any word can be generated without
+ * the ones before it, so a range can start anywhere.
+ */
+struct hello_pattern_gen {
+    u32 kind;
+    u64 seed;
+};
+
+static u64 hello_pattern_word(const struct hello_pattern_gen *g, u64 idx)
+{
+    u64 z;
+
+    switch (g->kind) {
+    case HELLO_PATTERN_CONST:
+        return g->seed;
+    case HELLO_PATTERN_INC:
+        return g->seed + idx;
+    }
+
+    z = g->seed + (idx + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static u8 hello_pattern_byte(const struct hello_pattern_gen *g, u64 pos)
+{
+    u64 w = hello_pattern_word(g, pos >> 3);
+
+    return ((u8 *)&w)[pos & 7];
+}
+
+/* pos is where addr sits in the buffer */
+static void hello_pattern_fill(const struct hello_pattern_gen *g, void *addr,
+                               u64 pos, size_t len)
+{
+    u8 *p = addr;
+    size_t n;
+
+    for (; len && (pos & 7); len--)
+        *p++ = hello_pattern_byte(g, pos++);
+
+    /* pos is word aligned now, p only is if the sg offset was */
+    n = len >> 3;
+    if (g->kind == HELLO_PATTERN_CONST && IS_ALIGNED((unsigned long)p, 8)) {
+        memset64((u64 *)p, g->seed, n);
+        p += n << 3;
+        pos += n << 3;
+    } else {
+        for (; n; n--, p += 8, pos += 8)
+            put_unaligned(hello_pattern_word(g, pos >> 3), (u64 *)p);
+    }
+
+    for (len &= 7; len; len--)
+        *p++ = hello_pattern_byte(g, pos++);
+}
+
+/* offset of the first byte that differs from the pattern, or -1 */
+static s64 hello_pattern_verify(const struct hello_pattern_gen *g, const void *addr,
+                                u64 pos, size_t len)
+{
+    const u8 *p = addr;
+    size_t i = 0;
+
+    for (; i < len && ((pos + i) & 7); i++)
+        if (p[i] != hello_pattern_byte(g, pos + i))
+            return i;
+
+    for (; i + 8 <= len; i += 8)
+        if (get_unaligned((const u64 *)(p + i)) != hello_pattern_word(g, (pos + i) >> 3))
+            break;
+
+    for (; i < len; i++)
+        if (p[i] != hello_pattern_byte(g, pos + i))
+            return i;
+
+    return -1;
+}
+
+struct hello_pattern_ctx {
+    struct sg_table *sgt;
+    u64 offset;
+    const struct hello_pattern_gen *g;
+    bool verify;
+};
+
+/* a mismatch leaves its buffer offset in pc->result */
+static int hello_pattern_chunk(struct hello_par *par, struct hello_par_chunk *pc)
+{
+    struct hello_pattern_ctx *x = par->priv;
+    struct hello_sg_cursor c;
+    u64 pos = x->offset + pc->start, end = pos + pc->len;
+    size_t chunk;
+    s64 bad;
+    int ret = 0;
+
+    hello_cursor_start(&c, x->sgt, pos, x->verify ? SG_MITER_FROM_SG : SG_MITER_TO_SG);
+    while (pos < end) {
+        if (!hello_cursor_next(&c)) {
+            ret = -EINVAL;
+            break;
+        }
+        chunk = min_t(u64, end - pos, c.avail);
+        if (x->verify) {
+            bad = hello_pattern_verify(x->g, c.addr, pos, chunk);
+            if (bad >= 0) {
+                pc->result = pos + bad;
+                ret = -EBADMSG;
+                break;
+            }
+        } else {
+            hello_pattern_fill(x->g, c.addr, pos, chunk);
+        }
+        hello_cursor_advance(&c, chunk);
+        pos += chunk;
+    }
+    hello_cursor_stop(&c);
+
+    return ret;
+}
+
+/*
+ * Write the pattern over [offset, offset + length), or compare against
+ * it and return -EBADMSG with *mismatch at the first byte that differs.
+ * Goes through the sg_table a kmapped chunk at a time, never a vmap.
+ */
+static int hello_pattern_range(struct hello_buf *buf, u64 offset, u64 length,
+                               const struct hello_pattern_gen *g, bool verify,
+                               u64 *mismatch)
+{
+    enum dma_data_direction dir = verify ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+    struct hello_pattern_ctx x = { .offset = offset, .g = g, .verify = verify };
+    struct hello_par par = { .fn = hello_pattern_chunk, .priv = &x };
+    u64 start = ktime_get_ns();
+    unsigned int i;
+    int ret;
+
+    if (!verify) {
+        ret = hello_buf_check_write(buf);
+        if (ret)
+            return ret;
+    }
+
+    x.sgt = hello_buf_pin_sgt(buf);
+    if (IS_ERR(x.sgt))
+        return PTR_ERR(x.sgt);
+    if (!hello_sgt_has_pages(x.sgt)) {
+        ret = -EOPNOTSUPP;
+        goto unpin;
+    }
+
+    ret = hello_buf_begin_cpu(buf, dir, offset, length);
+    if (ret)
+        goto unpin;
+
+    ret = hello_par_run(&par, length);
+    for (i = 0; ret == -EBADMSG && i < par.nr; i++) {
+        if (par.chunks[i].ret == -EBADMSG) {
+            *mismatch = par.chunks[i].result;
+            break;
+        }
+    }
+    hello_par_free(&par);
+
+    hello_buf_end_cpu(buf, dir, offset, length);
+    if (!ret)
+        hello_stats_add(buf->hdev, HELLO_PHASE_CPU, start);
+unpin:
+    hello_buf_unpin_sgt(buf);
+    return ret;
+}
+
+/* fill [offset, offset + length) with a byte */
+static int hello_fill_range(struct hello_buf *buf, u64 offset, u64 length, u8 value)
+{
+    struct hello_pattern_gen g = {
+        .kind = HELLO_PATTERN_CONST,
+        .seed = value * 0x0101010101010101ULL,
+    };
+
+    return hello_pattern_range(buf, offset, length, &g, false, NULL);
+}
+
+static long hello_ioctl_pattern(struct hello_file *hfile, unsigned long arg)
+{
+    struct hello_pattern req;
+    struct hello_pattern_gen g;
+    struct hello_buf *buf;
+    long ret;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)) != 0)
+        return -EFAULT;
+    if (req.flags || req.op > HELLO_PATTERN_VERIFY || req.kind > HELLO_PATTERN_PRNG)
+        return -EINVAL;
+
+    buf = hello_buf_lookup(hfile, req.handle);
+    if (!buf)
+        return -EINVAL;
+
+    ret = hello_buf_check_range(buf, req.offset, &req.length);
+    if (ret)
+        goto out;
+
+    g.kind = req.kind;
+    g.seed = req.seed;
+    req.mismatch = U64_MAX;
+    ret = hello_pattern_range(buf, req.offset, req.length, &g,
+                              req.op == HELLO_PATTERN_VERIFY, &req.mismatch);
+    if ((!ret || ret == -EBADMSG) &&
+        copy_to_user((void __user *)arg, &req, sizeof(req)) != 0)
+        ret = -EFAULT;
+out:
+    hello_buf_put(buf);
+    return ret;
+}
+
+/* crc32c of a chunk, seeded with 0 unless it starts the request */
+struct hello_crc_ctx {
+    struct sg_table *sgt;
+    u64 offset;
+    u32 seed;
+};
+
+static int hello_crc_chunk(struct hello_par *par, struct hello_par_chunk *pc)
+{
+    struct hello_crc_ctx *x = par->priv;
+    struct hello_sg_cursor c;
+    u64 left = pc->len;
+    u32 crc = pc->start ? 0 : x->seed;
+    size_t chunk;
+    int ret = 0;
+
+    hello_cursor_start(&c, x->sgt, x->offset + pc->start, SG_MITER_FROM_SG);
+    while (left) {
+        if (!hello_cursor_next(&c)) {
+            ret = -EINVAL;
+            break;
+        }
+        chunk = min_t(u64, left, c.avail);
+        crc = crc32c(crc, c.addr, chunk);
+        hello_cursor_advance(&c, chunk);
+        left -= chunk;
+    }
+    hello_cursor_stop(&c);
+
+    pc->result = crc;
+    return ret;
+}
+
+static int hello_crc_range(struct hello_buf *buf, u64 offset, u64 length, u32 *crc)
+{
+    struct hello_crc_ctx x = { .offset = offset, .seed = *crc };
+    struct hello_par par = { .fn = hello_crc_chunk, .priv = &x };
+    u64 start = ktime_get_ns();
+    unsigned int i;
+    int ret;
+
+    x.sgt = hello_buf_pin_sgt(buf);
+    if (IS_ERR(x.sgt))
+        return PTR_ERR(x.sgt);
+    if (!hello_sgt_has_pages(x.sgt)) {
+        ret = -EOPNOTSUPP;
+        goto unpin;
+    }
+
+    ret = hello_buf_begin_cpu(buf, DMA_FROM_DEVICE, offset, length);
+    if (ret)
+        goto unpin;
+
+    ret = hello_par_run(&par, length);
+    if (!ret) {
+        *crc = par.chunks[0].result;
+        for (i = 1; i < par.nr; i++)
+            *crc = __crc32c_le_combine(*crc, par.chunks[i].result,
+                                       par.chunks[i].len);
+    }
+    hello_par_free(&par);
+
+    hello_buf_end_cpu(buf, DMA_FROM_DEVICE, offset, length);
+    if (!ret)
+        hello_stats_add(buf->hdev, HELLO_PHASE_CPU, start);
+unpin:
+    hello_buf_unpin_sgt(buf);
+    return ret;
+}
+
+static long hello_ioctl_checksum(struct hello_file *hfile, unsigned long arg)
+{
+    struct hello_checksum req;
+    struct hello_buf *buf;
+    long ret;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)) != 0)
+        return -EFAULT;
+    if (req.flags)
+        return -EINVAL;
+
+    buf = hello_buf_lookup(hfile, req.handle);
+    if (!buf)
+        return -EINVAL;
+
+    ret = hello_buf_check_range(buf, req.offset, &req.length);
+    if (!ret)
+        ret = hello_crc_range(buf, req.offset, req.length, &req.crc);
+    if (!ret && copy_to_user((void __user *)arg, &req, sizeof(req)) != 0)
+        ret = -EFAULT;
+
+    hello_buf_put(buf);
+    return ret;
+}
+
+/*
+ * Validate a copy, a zero length means up to the end of src. Copies
+ * within one buffer must not overlap.
+ */
+static int hello_copy_check(struct hello_buf *dst, u64 dst_off,
+                            struct hello_buf *src, u64 src_off, u64 *length)
+{
+    int ret;
+
+    ret = hello_buf_check_range(src, src_off, length);
+    if (!ret)
+        ret = hello_buf_check_range(dst, dst_off, length);
+    if (ret)
+        return ret;
+
+    if (src->dma_buf == dst->dma_buf &&
+        src_off < dst_off + *length && dst_off < src_off + *length)
+        return -EINVAL;
+
+    return 0;
+}
+
+static long hello_ioctl_copy(struct hello_file *hfile, unsigned long arg)
+{
+    struct hello_copy req;
+    struct hello_buf *src, *dst;
+    bool by_handle;
+    long ret;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)) != 0)
+        return -EFAULT;
+    if (req.flags & ~HELLO_COPY_HANDLES)
+        return -EINVAL;
+
+    by_handle = req.flags & HELLO_COPY_HANDLES;
+    if (by_handle && (!req.src || !req.dst))
+        return -EINVAL;
+
+    /* the cpu only reads src and only writes dst */
+    src = hello_buf_get(hfile, by_handle ? req.src : 0, req.src, DMA_FROM_DEVICE);
+    if (IS_ERR(src))
+        return PTR_ERR(src);
+    dst = hello_buf_get(hfile, by_handle ? req.dst : 0, req.dst, DMA_TO_DEVICE);
+    if (IS_ERR(dst)) {
+        ret = PTR_ERR(dst);
+        goto put_src;
+    }
+
+    ret = hello_copy_check(dst, req.dst_offset, src, req.src_offset, &req.length);
+    if (!ret)
+        ret = hello_copy_range(dst, req.dst_offset, src, req.src_offset, req.length);
+
+    hello_buf_put(dst);
+put_src:
+    hello_buf_put(src);
+    return ret;
+}
+
+/*
+ * Fused chains: up to HELLO_CHAIN_MAX copy/fill/xor/crc32c ops over the
+ * same length, run one page wide window at a time. Every op handles the
+ * window before the next window starts, so what "copy A to B" just
+ * wrote is still in cache when "crc32c of B" reads it. Long chains are
+ * split across cpus like any other cpu operation.
+ */
+
+/* every buffer a chain touches, pinned and cpu accessed once */
+struct hello_chain_buf {
+    struct hello_buf *buf;
+    struct sg_table *sgt;
+    u64 start;
+    u64 end;
+    bool read;
+    bool write;
+};
+
+struct hello_chain_link {
+    u32 op;
+    struct hello_chain_buf *dst;
+    struct hello_chain_buf *src;
+    u64 dst_off;
+    u64 src_off;
+    struct hello_pattern_gen g;
+    u32 seed;
+};
+
+struct hello_chain_ctx {
+    struct hello_chain_link links[HELLO_CHAIN_MAX];
+    unsigned int nr;
+    struct hello_chain_buf bufs[2 * HELLO_CHAIN_MAX];
+    unsigned int nr_bufs;
+    /* crc32c of every op per chunk, combined once all chunks are done */
+    u32 crcs[HELLO_PAR_MAX][HELLO_CHAIN_MAX];
+};
+
+struct hello_chain_cursors {
+    struct hello_sg_cursor dst;
+    struct hello_sg_cursor src;
+};
+
+static void hello_xor(u8 *dst, const u8 *src, size_t len)
+{
+    for (; len >= sizeof(long); len -= sizeof(long), dst += sizeof(long), src += sizeof(long))
+        put_unaligned(get_unaligned((unsigned long *)dst) ^
+                      get_unaligned((const unsigned long *)src), (unsigned long *)dst);
+    while (len--)
+        *dst++ ^= *src++;
+}
+
+/* one op over [rel, rel + len) of the chain */
+static int hello_chain_link_step(struct hello_chain_link *l, struct hello_chain_cursors *cur,
+                                 u64 rel, size_t len, u32 *crc)
+{
+    size_t n;
+
+    while (len) {
+        if ((l->dst && !hello_cursor_next(&cur->dst)) ||
+            (l->src && !hello_cursor_next(&cur->src)))
+            return -EINVAL;
+
+        n = len;
+        if (l->dst)
+            n = min(n, cur->dst.avail);
+        if (l->src)
+            n = min(n, cur->src.avail);
+
+        switch (l->op) {
+        case HELLO_CHAIN_COPY:
+            memcpy(cur->dst.addr, cur->src.addr, n);
+            break;
+        case HELLO_CHAIN_FILL:
+            hello_pattern_fill(&l->g, cur->dst.addr, l->dst_off + rel, n);
+            break;
+        case HELLO_CHAIN_XOR:
+            hello_xor(cur->dst.addr, cur->src.addr, n);
+            break;
+        case HELLO_CHAIN_CRC32C:
+            *crc = crc32c(*crc, cur->src.addr, n);
+            break;
+        }
+
+        if (l->dst)
+            hello_cursor_advance(&cur->dst, n);
+        if (l->src)
+            hello_cursor_advance(&cur->src, n);
+        rel += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int hello_chain_chunk(struct hello_par *par, struct hello_par_chunk *pc)
+{
+    struct hello_chain_ctx *x = par->priv;
+    u32 *crc = x->crcs[pc - par->chunks];
+    struct hello_chain_cursors *cur;
+    struct hello_chain_link *l;
+    u64 rel = pc->start, end = pc->start + pc->len;
+    unsigned int flags, i;
+    int ret = 0;
+
+    cur = kcalloc(x->nr, sizeof(*cur), GFP_KERNEL);
+    if (!cur)
+        return -ENOMEM;
+
+    for (i = 0; i < x->nr; i++) {
+        l = &x->links[i];
+        if (l->dst) {
+            flags = SG_MITER_TO_SG;
+            if (l->op == HELLO_CHAIN_XOR)
+                flags |= SG_MITER_FROM_SG;
+            hello_cursor_start(&cur[i].dst, l->dst->sgt, l->dst_off + rel, flags);
+        }
+        if (l->src)
+            hello_cursor_start(&cur[i].src, l->src->sgt, l->src_off + rel,
+                               SG_MITER_FROM_SG);
+        crc[i] = pc->start ? 0 : l->seed;
+    }
+
+    for (; rel < end && !ret; rel += PAGE_SIZE)
+        for (i = 0; i < x->nr && !ret; i++)
+            ret = hello_chain_link_step(&x->links[i], &cur[i], rel,
+                                        min_t(u64, end - rel, PAGE_SIZE), &crc[i]);
+
+    for (i = 0; i < x->nr; i++) {
+        if (x->links[i].dst)
+            hello_cursor_stop(&cur[i].dst);
+        if (x->links[i].src)
+            hello_cursor_stop(&cur[i].src);
+    }
+    kfree(cur);
+    return ret;
+}
+
+/* look a handle up once per chain and widen the range the chain uses */
+static struct hello_chain_buf *hello_chain_buf_get(struct hello_file *hfile,
+                                                   struct hello_chain_ctx *x, u32 handle,
+                                                   u64 offset, u64 length, bool write)
+{
+    struct hello_chain_buf *cb = NULL;
+    struct hello_buf *buf;
+    unsigned int i;
+
+    buf = hello_buf_lookup(hfile, handle);
+    if (!buf)
+        return ERR_PTR(-EINVAL);
+
+    for (i = 0; i < x->nr_bufs; i++) {
+        if (x->bufs[i].buf == buf) {
+            cb = &x->bufs[i];
+            hello_buf_put(buf);
+            break;
+        }
+    }
+    if (!cb) {
+        cb = &x->bufs[x->nr_bufs++];
+        cb->buf = buf;
+        cb->start = offset;
+        cb->end = offset;
+    }
+
+    cb->start = min(cb->start, offset);
+    cb->end = max(cb->end, offset + length);
+    if (write)
+        cb->write = true;
+    else
+        cb->read = true;
+    return cb;
+}
+
+static enum dma_data_direction hello_chain_buf_dir(struct hello_chain_buf *cb)
+{
+    if (cb->read && cb->write)
+        return DMA_BIDIRECTIONAL;
+    return cb->write ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+}
+
+static int hello_chain_link_init(struct hello_file *hfile, struct hello_chain_ctx *x,
+                                 struct hello_chain_link *l, struct hello_chain_op *op,
+                                 u64 length)
+{
+    u64 len = length;
+    int ret;
+
+    if (op->op > HELLO_CHAIN_CRC32C)
+        return -EINVAL;
+    if (op->op == HELLO_CHAIN_FILL && op->kind > HELLO_PATTERN_PRNG)
+        return -EINVAL;
+
+    l->op = op->op;
+    l->dst_off = op->dst_offset;
+    l->src_off = op->src_offset;
+    l->g.kind = op->kind;
+    l->g.seed = op->seed;
+    l->seed = op->seed;
+
+    if (op->op != HELLO_CHAIN_CRC32C) {
+        l->dst = hello_chain_buf_get(hfile, x, op->dst, op->dst_offset, length, true);
+        if (IS_ERR(l->dst))
+            return PTR_ERR(l->dst);
+        /* xor reads what it writes */
+        if (op->op == HELLO_CHAIN_XOR)
+            l->dst->read = true;
+        ret = hello_buf_check_write(l->dst->buf);
+        if (ret)
+            return ret;
+    }
+    if (op->op != HELLO_CHAIN_FILL) {
+        l->src = hello_chain_buf_get(hfile, x, op->src, op->src_offset, length, false);
+        if (IS_ERR(l->src))
+            return PTR_ERR(l->src);
+    }
+
+    if (l->dst && l->src)
+        ret = hello_copy_check(l->dst->buf, l->dst_off, l->src->buf, l->src_off, &len);
+    else if (l->dst)
+        ret = hello_buf_check_range(l->dst->buf, l->dst_off, &len);
+    else
+        ret = hello_buf_check_range(l->src->buf, l->src_off, &len);
+
+    return ret;
+}
+
+/* a and b overlap on one dma_buf without lining up */
+static bool hello_chain_aliases(struct hello_chain_buf *a, u64 a_off,
+                                struct hello_chain_buf *b, u64 b_off, u64 length)
+{
+    return a->buf->dma_buf == b->buf->dma_buf && a_off != b_off &&
+           a_off < b_off + length && b_off < a_off + length;
+}
+
+/*
+ * The page walk and the parallel chunks only keep ops in order for bytes
+ * at the same offset, so whatever one op writes, the others may touch at
+ * exactly that offset or not at all.
+ */
+static int hello_chain_check_alias(struct hello_chain_ctx *x, u64 length)
+{
+    struct hello_chain_link *w, *l;
+    unsigned int i, j;
+
+    for (i = 0; i < x->nr; i++) {
+        w = &x->links[i];
+        if (!w->dst)
+            continue;
+        for (j = 0; j < x->nr; j++) {
+            if (j == i)
+                continue;
+            l = &x->links[j];
+            if (l->dst && hello_chain_aliases(w->dst, w->dst_off, l->dst, l->dst_off, length))
+                return -EINVAL;
+            if (l->src && hello_chain_aliases(w->dst, w->dst_off, l->src, l->src_off, length))
+                return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+static void hello_chain_put(struct hello_chain_ctx *x)
+{
+    unsigned int i;
+
+    for (i = 0; i < x->nr_bufs; i++)
+        hello_buf_put(x->bufs[i].buf);
+    kfree(x);
+}
+
+static long hello_ioctl_chain(struct hello_file *hfile, unsigned long arg)
+{
+    struct hello_chain req;
+    struct hello_chain_op *ops;
+    struct hello_chain_ctx *x;
+    struct hello_chain_buf *cb;
+    struct hello_par par = { .fn = hello_chain_chunk };
+    void __user *uops;
+    unsigned int started, i, c;
+    u64 start = ktime_get_ns();
+    size_t size;
+    long ret = 0;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)) != 0)
+        return -EFAULT;
+    if (req.flags || !req.count || req.count > HELLO_CHAIN_MAX || !req.length)
+        return -EINVAL;
+
+    uops = u64_to_user_ptr(req.ops);
+    size = array_size(req.count, sizeof(*ops));
+    ops = memdup_user(uops, size);
+    if (IS_ERR(ops))
+        return PTR_ERR(ops);
+
+    x = kzalloc(sizeof(*x), GFP_KERNEL);
+    if (!x) {
+        ret = -ENOMEM;
+        goto free_ops;
+    }
+    par.priv = x;
+
+    for (i = 0; i < req.count; i++) {
+        ret = hello_chain_link_init(hfile, x, &x->links[i], &ops[i], req.length);
+        if (ret)
+            goto put;
+        x->nr++;
+    }
+    ret = hello_chain_check_alias(x, req.length);
+    if (ret)
+        goto put;
+
+    for (started = 0; started < x->nr_bufs; started++) {
+        cb = &x->bufs[started];
+        cb->sgt = hello_buf_pin_sgt(cb->buf);
+        if (IS_ERR(cb->sgt)) {
+            ret = PTR_ERR(cb->sgt);
+            goto end;
+        }
+        if (!hello_sgt_has_pages(cb->sgt))
+            ret = -EOPNOTSUPP;
+        else
+            ret = hello_buf_begin_cpu(cb->buf, hello_chain_buf_dir(cb), cb->start,
+                                      cb->end - cb->start);
+        if (ret) {
+            hello_buf_unpin_sgt(cb->buf);
+            goto end;
+        }
+    }
+
+    ret = hello_par_run(&par, req.length);
+    for (i = 0; !ret && i < x->nr; i++) {
+        if (x->links[i].op != HELLO_CHAIN_CRC32C)
+            continue;
+        ops[i].seed = x->crcs[0][i];
+        for (c = 1; c < par.nr; c++)
+            ops[i].seed = __crc32c_le_combine(ops[i].seed, x->crcs[c][i],
+                                              par.chunks[c].len);
+    }
+    hello_par_free(&par);
+
+end:
+    while (started--) {
+        cb = &x->bufs[started];
+        hello_buf_end_cpu(cb->buf, hello_chain_buf_dir(cb), cb->start, cb->end - cb->start);
+        hello_buf_unpin_sgt(cb->buf);
+    }
+    if (!ret) {
+        hello_stats_add(hfile->hdev, HELLO_PHASE_CPU, start);
+        if (copy_to_user(uops, ops, size) != 0)
+            ret = -EFAULT;
+    }
+put:
+    hello_chain_put(x);
+free_ops:
+    kfree(ops);
+    return ret;
+}
+
+/*
+ * Summarise the dma side of a mapping: segment sizes, contiguous runs and
+ * whether the iommu merged anything. The first max_segs segments are
+ * also handed back as (addr, len) pairs.
+ */
+static long hello_ioctl_query_sg(struct hello_file *hfile, unsigned long arg)
+{
+    struct hello_sg_query req;
+    struct hello_sg_seg seg;
+    struct hello_sg_seg __user *usegs;
+    struct hello_buf *buf;
+    struct sg_table *sgt;
+    struct scatterlist *sg;
+    dma_addr_t run_end = 0;
+    u64 run = 0;
+    unsigned int len;
+    u32 max_segs;
+    long ret = 0;
+    int i;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)) != 0)
+        return -EFAULT;
+
+    usegs = u64_to_user_ptr(req.segs);
+    max_segs = usegs ? min_t(u32, req.max_segs, HELLO_SG_QUERY_MAX) : 0;
+
+    buf = hello_buf_get(hfile, req.handle, req.fd, hfile->hdev->dir);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+
+    sgt = hello_buf_pin_sgt(buf);
+    if (IS_ERR(sgt)) {
+        ret = PTR_ERR(sgt);
+        goto put;
+    }
+
+    /* clear the out fields, fd/handle and segs/max_segs are left as passed */
+    memset(&req.flags, 0, offsetof(struct hello_sg_query, segs) -
+                          offsetof(struct hello_sg_query, flags));
+    req.nr_segs = 0;
+    req.nents = sgt->nents;
+    req.orig_nents = sgt->orig_nents;
+    req.size = buf->dma_buf->size;
+    if (req.nents < req.orig_nents)
+        req.flags |= HELLO_SG_IOMMU_MERGED;
+    if (buf->bounced)
+        req.flags |= HELLO_SG_BOUNCED;
+
+    for_each_sgtable_dma_sg(sgt, sg, i) {
+        len = sg_dma_len(sg);
+        if (!len)
+            continue;
+
+        req.hist[ilog2(len)]++;
+        if (!req.smallest_seg || len < req.smallest_seg)
+            req.smallest_seg = len;
+
+        if (run && sg_dma_address(sg) == run_end) {
+            run += len;
+        } else {
+            run = len;
+            req.nr_runs++;
+        }
+        run_end = sg_dma_address(sg) + len;
+        req.largest_run = max(req.largest_run, run);
+
+        if (req.nr_segs < max_segs) {
+            seg.addr = sg_dma_address(sg);
+            seg.len = len;
+            if (copy_to_user(&usegs[req.nr_segs], &seg, sizeof(seg)) != 0) {
+                ret = -EFAULT;
+                goto unpin;
+            }
+            req.nr_segs++;
+        }
+    }
+
+    if (copy_to_user((void __user *)arg, &req, sizeof(req)) != 0)
+        ret = -EFAULT;
+unpin:
+    hello_buf_unpin_sgt(buf);
+put:
+    hello_buf_put(buf);
+    return ret;
+}
+
+/*
+ * Exporter side: TEST_DRIVER_ALLOC hands out dma-bufs backed by a page
+ * pool with one free list per order, like the system heap. Released
+ * buffers are zeroed off the allocation path and go back to the pool,
+ * so steady-state allocation neither hits the page allocator nor zeroes.
+ *
+ * HELLO_ALLOC_HUGE buffers are built from PMD sized compound pages, so
+ * they map as a handful of large segments. Plain buffers stop at order 8
+ * and never take huge pages out of the pool.
+ */
+#if PMD_SHIFT - PAGE_SHIFT < MAX_ORDER
+#define HELLO_HUGE_ORDER    (PMD_SHIFT - PAGE_SHIFT)
+#else
+#define HELLO_HUGE_ORDER    (MAX_ORDER - 1)
+#endif
+#define HELLO_HUGE_SIZE     (PAGE_SIZE << HELLO_HUGE_ORDER)
+
+static const unsigned int hello_pool_orders[] = { HELLO_HUGE_ORDER, 8, 4, 0 };
+#define HELLO_POOL_NR_ORDERS ARRAY_SIZE(hello_pool_orders)
+#define HELLO_POOL_MAX_ORDER 8
+
+static unsigned int pool_max_mb = 64;
+module_param(pool_max_mb, uint, 0644);
+MODULE_PARM_DESC(pool_max_mb, "Upper bound of the exporter page pool in MiB");
+
+struct hello_page_pool {
+    spinlock_t lock;
+    struct list_head items[HELLO_POOL_NR_ORDERS];
+    unsigned long count[HELLO_POOL_NR_ORDERS];
+    /* in PAGE_SIZE units, across all orders */
+    unsigned long nr_pages;
+};
+
+static struct hello_page_pool hello_pool;
+
+struct hello_export {
+    struct mutex lock;
+    struct list_head attachments;
+    size_t size;
+    /* one entry per pool chunk */
+    struct sg_table sgt;
+    /* pinned user pages backing a userptr buffer, NULL for pool pages */
+    struct page **upages;
+    int vmap_cnt;
+    void *vaddr;
+    struct work_struct free_work;
+};
+
+struct hello_export_attach {
+    struct device *dev;
+    struct sg_table table;
+    struct list_head list;
+    enum dma_data_direction dir;
+    bool mapped;
+};
+
+static gfp_t hello_pool_gfp(unsigned int order)
+{
+    /* huge pages are what the caller asked for, worth compacting for */
+    if (order == HELLO_HUGE_ORDER)
+        return GFP_HIGHUSER | __GFP_ZERO | __GFP_NOWARN | __GFP_RETRY_MAYFAIL |
+               __GFP_COMP;
+    /* high orders are opportunistic, fall back to smaller ones instead */
+    if (order)
+        return ((GFP_HIGHUSER | __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY) &
+                ~__GFP_RECLAIM) | __GFP_COMP;
+    return GFP_HIGHUSER | __GFP_ZERO;
+}
+
+static int hello_pool_index(unsigned int order)
+{
+    int i;
+
+    for (i = 0; i < HELLO_POOL_NR_ORDERS; i++)
+        if (hello_pool_orders[i] == order)
+            return i;
+    return -1;
+}
+
+static struct page *hello_pool_fetch(int idx)
+{
+    struct page *page;
+
+    spin_lock(&hello_pool.lock);
+    page = list_first_entry_or_null(&hello_pool.items[idx], struct page, lru);
+    if (page) {
+        list_del(&page->lru);
+        hello_pool.count[idx]--;
+        hello_pool.nr_pages -= 1UL << hello_pool_orders[idx];
+    }
+    spin_unlock(&hello_pool.lock);
+
+    return page;
+}
+
+/* pages handed back here must already be zeroed */
+static void hello_pool_free(struct page *page)
+{
+    unsigned int order = compound_order(page);
+    int idx = hello_pool_index(order);
+    unsigned long max_pages = (unsigned long)pool_max_mb << (20 - PAGE_SHIFT);
+
+    spin_lock(&hello_pool.lock);
+    if (idx < 0 || hello_pool.nr_pages + (1UL << order) > max_pages) {
+        spin_unlock(&hello_pool.lock);
+        __free_pages(page, order);
+        return;
+    }
+    list_add(&page->lru, &hello_pool.items[idx]);
+    hello_pool.count[idx]++;
+    hello_pool.nr_pages += 1UL << order;
+    spin_unlock(&hello_pool.lock);
+}
+
+static struct page *hello_pool_alloc_largest(unsigned long size,
+                                             unsigned int max_order)
+{
+    struct page *page;
+    unsigned int order;
+    int i;
+
+    for (i = 0; i < HELLO_POOL_NR_ORDERS; i++) {
+        order = hello_pool_orders[i];
+        if (size < (PAGE_SIZE << order) || order > max_order)
+            continue;
+
+        page = hello_pool_fetch(i);
+        if (!page)
+            page = alloc_pages(hello_pool_gfp(order), order);
+        if (page)
+            return page;
+    }
+
+    return NULL;
+}
+
+static unsigned long hello_pool_drain(unsigned long nr_to_free)
+{
+    unsigned long freed = 0;
+    struct page *page;
+    int i;
+
+    for (i = 0; i < HELLO_POOL_NR_ORDERS; i++) {
+        while (freed < nr_to_free) {
+            page = hello_pool_fetch(i);
+            if (!page)
+                break;
+            __free_pages(page, hello_pool_orders[i]);
+            freed += 1UL << hello_pool_orders[i];
+        }
+    }
+
+    return freed;
+}
+
+static unsigned long hello_pool_shrink_count(struct shrinker *shrinker,
+                                             struct shrink_control *sc)
+{
+    unsigned long nr = READ_ONCE(hello_pool.nr_pages);
+
+    return nr ? nr : SHRINK_EMPTY;
+}
+
+static unsigned long hello_pool_shrink_scan(struct shrinker *shrinker,
+                                            struct shrink_control *sc)
+{
+    unsigned long freed = hello_pool_drain(sc->nr_to_scan);
+
+    return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker hello_pool_shrinker = {
+    .count_objects = hello_pool_shrink_count,
+    .scan_objects = hello_pool_shrink_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+
+static void hello_page_zero(struct page *page)
+{
+    unsigned int i;
+
+    for (i = 0; i < compound_nr(page); i++)
+        clear_highpage(page + i);
+}
+
+static int hello_export_attach(struct dma_buf *dmabuf,
+                               struct dma_buf_attachment *attachment)
+{
+    struct hello_export *exp = dmabuf->priv;
+    struct hello_export_attach *a;
+    struct scatterlist *sg, *new_sg;
+    int i, ret;
+
+    a = kzalloc(sizeof(*a), GFP_KERNEL);
+    if (!a)
+        return -ENOMEM;
+
+    /* every attachment needs its own copy to hold its dma addresses */
+    ret = sg_alloc_table(&a->table, exp->sgt.orig_nents, GFP_KERNEL);
+    if (ret) {
+        kfree(a);
+        return ret;
+    }
+    new_sg = a->table.sgl;
+    for_each_sgtable_sg(&exp->sgt, sg, i) {
+        sg_set_page(new_sg, sg_page(sg), sg->length, sg->offset);
+        new_sg = sg_next(new_sg);
+    }
+
+    a->dev = attachment->dev;
+    INIT_LIST_HEAD(&a->list);
+    attachment->priv = a;
+
+    mutex_lock(&exp->lock);
+    list_add(&a->list, &exp->attachments);
+    mutex_unlock(&exp->lock);
+
+    return 0;
+}
+
+static void hello_export_detach(struct dma_buf *dmabuf,
+                                struct dma_buf_attachment *attachment)
+{
+    struct hello_export *exp = dmabuf->priv;
+    struct hello_export_attach *a = attachment->priv;
+
+    mutex_lock(&exp->lock);
+    list_del(&a->list);
+    mutex_unlock(&exp->lock);
+
+    sg_free_table(&a->table);
+    kfree(a);
+}
+
+static struct sg_table *hello_export_map(struct dma_buf_attachment *attachment,
+                                         enum dma_data_direction dir)
+{
+    struct hello_export_attach *a = attachment->priv;
+    int ret;
+
+    ret = dma_map_sgtable(attachment->dev, &a->table, dir, 0);
+    if (ret)
+        return ERR_PTR(ret);
+
+    a->dir = dir;
+    a->mapped = true;
+    return &a->table;
+}
+
+static void hello_export_unmap(struct dma_buf_attachment *attachment,
+                               struct sg_table *table,
+                               enum dma_data_direction dir)
+{
+    struct hello_export_attach *a = attachment->priv;
+
+    a->mapped = false;
+    dma_unmap_sgtable(attachment->dev, table, dir, 0);
+}
+
+static int hello_export_begin_cpu_access(struct dma_buf *dmabuf,
+                                         enum dma_data_direction dir)
+{
+    struct hello_export *exp = dmabuf->priv;
+    struct hello_export_attach *a;
+
+    mutex_lock(&exp->lock);
+    if (exp->vmap_cnt)
+        invalidate_kernel_vmap_range(exp->vaddr, exp->size);
+    list_for_each_entry(a, &exp->attachments, list) {
+        if (a->mapped)
+            dma_sync_sgtable_for_cpu(a->dev, &a->table, a->dir);
+    }
+    mutex_unlock(&exp->lock);
+
+    return 0;
+}
+
+static int hello_export_end_cpu_access(struct dma_buf *dmabuf,
+                                       enum dma_data_direction dir)
+{
+    struct hello_export *exp = dmabuf->priv;
+    struct hello_export_attach *a;
+
+    mutex_lock(&exp->lock);
+    if (exp->vmap_cnt)
+        flush_kernel_vmap_range(exp->vaddr, exp->size);
+    list_for_each_entry(a, &exp->attachments, list) {
+        if (a->mapped)
+            dma_sync_sgtable_for_device(a->dev, &a->table, a->dir);
+    }
+    mutex_unlock(&exp->lock);
+
+    return 0;
+}
+
+#ifdef CONFIG_MY_TEST_DMA_BUF_PARTIAL
+static int hello_export_begin_cpu_access_partial(struct dma_buf *dmabuf,
+                                                 enum dma_data_direction dir,
+                                                 unsigned int offset,
+                                                 unsigned int len)
+{
+    struct hello_export *exp = dmabuf->priv;
+    struct hello_export_attach *a;
+
+    mutex_lock(&exp->lock);
+    if (exp->vmap_cnt)
+        invalidate_kernel_vmap_range(exp->vaddr + offset, len);
+    list_for_each_entry(a, &exp->attachments, list) {
+        if (a->mapped)
+            hello_sgt_sync_range(a->dev, &a->table, a->dir, offset, len, true);
+    }
+    mutex_unlock(&exp->lock);
+
+    return 0;
+}
+
+static int hello_export_end_cpu_access_partial(struct dma_buf *dmabuf,
+                                               enum dma_data_direction dir,
+                                               unsigned int offset,
+                                               unsigned int len)
+{
+    struct hello_export *exp = dmabuf->priv;
+    struct hello_export_attach *a;
+
+    mutex_lock(&exp->lock);
+    if (exp->vmap_cnt)
+        flush_kernel_vmap_range(exp->vaddr + offset, len);
+    list_for_each_entry(a, &exp->attachments, list) {
+        if (a->mapped)
+            hello_sgt_sync_range(a->dev, &a->table, a->dir, offset, len, false);
+    }
+    mutex_unlock(&exp->lock);
+
+    return 0;
+}
+#endif
+
+static int hello_export_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+    struct hello_export *exp = dmabuf->priv;
+    struct sg_page_iter piter;
+    unsigned long addr = vma->vm_start;
+    int ret;
+
+    for_each_sgtable_page(&exp->sgt, &piter, vma->vm_pgoff) {
+        ret = remap_pfn_range(vma, addr, page_to_pfn(sg_page_iter_page(&piter)),
+                              PAGE_SIZE, vma->vm_page_prot);
+        if (ret)
+            return ret;
+        addr += PAGE_SIZE;
+        if (addr >= vma->vm_end)
+            return 0;
+    }
+
+    return 0;
+}
+
+static void *hello_export_do_vmap(struct hello_export *exp)
+{
+    unsigned int npages = PAGE_ALIGN(exp->size) >> PAGE_SHIFT;
+    struct sg_page_iter piter;
+    struct page **pages, **tmp;
+    void *vaddr;
+
+    pages = vmalloc(array_size(npages, sizeof(*pages)));
+    if (!pages)
+        return NULL;
+
+    tmp = pages;
+    for_each_sgtable_page(&exp->sgt, &piter, 0)
+        *tmp++ = sg_page_iter_page(&piter);
+
+    vaddr = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+    vfree(pages);
+
+    return vaddr;
+}
+
+static void *hello_export_vmap(struct dma_buf *dmabuf)
+{
+    struct hello_export *exp = dmabuf->priv;
+    void *vaddr;
+
+    mutex_lock(&exp->lock);
+    if (!exp->vmap_cnt) {
+        exp->vaddr = hello_export_do_vmap(exp);
+        if (!exp->vaddr) {
+            mutex_unlock(&exp->lock);
+            return NULL;
+        }
+    }
+    exp->vmap_cnt++;
+    vaddr = exp->vaddr;
+    mutex_unlock(&exp->lock);
+
+    return vaddr;
+}
+
+static void hello_export_vunmap(struct dma_buf *dmabuf, void *vaddr)
+{
+    struct hello_export *exp = dmabuf->priv;
+
+    mutex_lock(&exp->lock);
+    if (!--exp->vmap_cnt) {
+        vunmap(exp->vaddr);
+        exp->vaddr = NULL;
+    }
+    mutex_unlock(&exp->lock);
+}
+
+static void hello_export_free_work(struct work_struct *work)
+{
+    struct hello_export *exp = container_of(work, struct hello_export, free_work);
+    struct scatterlist *sg;
+    int i;
+
+    if (exp->upages) {
+        /* the device may have written to them */
+        unpin_user_pages_dirty_lock(exp->upages, exp->size >> PAGE_SHIFT, true);
+        kvfree(exp->upages);
+    } else {
+        for_each_sgtable_sg(&exp->sgt, sg, i) {
+            hello_page_zero(sg_page(sg));
+            hello_pool_free(sg_page(sg));
+        }
+    }
+    sg_free_table(&exp->sgt);
+    kfree(exp);
+}
+
+static void hello_export_release(struct dma_buf *dmabuf)
+{
+    struct hello_export *exp = dmabuf->priv;
+
+    /* zeroing is the expensive part, keep it off the caller's path */
+    INIT_WORK(&exp->free_work, hello_export_free_work);
+    queue_work(hello_wq, &exp->free_work);
+}
+
+static const struct dma_buf_ops hello_export_ops = {
+    .attach = hello_export_attach,
+    .detach = hello_export_detach,
+    .map_dma_buf = hello_export_map,
+    .unmap_dma_buf = hello_export_unmap,
+    .begin_cpu_access = hello_export_begin_cpu_access,
+    .end_cpu_access = hello_export_end_cpu_access,
+#ifdef CONFIG_MY_TEST_DMA_BUF_PARTIAL
+    .begin_cpu_access_partial = hello_export_begin_cpu_access_partial,
+    .end_cpu_access_partial = hello_export_end_cpu_access_partial,
+#endif
+    .mmap = hello_export_mmap,
+    .vmap = hello_export_vmap,
+    .vunmap = hello_export_vunmap,
+    .release = hello_export_release,
+};
+
+static struct dma_buf *hello_export_alloc(size_t len, u32 flags)
+{
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    struct hello_export *exp;
+    struct dma_buf *dmabuf;
+    struct page *page, *tmp;
+    struct scatterlist *sg;
+    struct list_head pages;
+    unsigned long size_remaining;
+    unsigned int max_order = HELLO_POOL_MAX_ORDER;
+    int nents = 0;
+    int ret = -ENOMEM;
+    int i;
+
+    exp = kzalloc(sizeof(*exp), GFP_KERNEL);
+    if (!exp)
+        return ERR_PTR(-ENOMEM);
+
+    mutex_init(&exp->lock);
+    INIT_LIST_HEAD(&exp->attachments);
+    exp->size = PAGE_ALIGN(len);
+    if (flags & HELLO_ALLOC_HUGE) {
+        /*
+         * Round up so every chunk can be huge. Under fragmentation the
+         * allocation still falls back to smaller orders, QUERY_SG shows
+         * what was actually handed out.
+         */
+        exp->size = ALIGN(exp->size, HELLO_HUGE_SIZE);
+        max_order = HELLO_HUGE_ORDER;
+    }
+
+    INIT_LIST_HEAD(&pages);
+    size_remaining = exp->size;
+    while (size_remaining > 0) {
+        if (fatal_signal_pending(current)) {
+            ret = -EINTR;
+            goto err_pages;
+        }
+
+        page = hello_pool_alloc_largest(size_remaining, max_order);
+        if (!page)
+            goto err_pages;
+
+        list_add_tail(&page->lru, &pages);
+        size_remaining -= page_size(page);
+        max_order = compound_order(page);
+        nents++;
+    }
+
+    ret = sg_alloc_table(&exp->sgt, nents, GFP_KERNEL);
+    if (ret)
+        goto err_pages;
+
+    sg = exp->sgt.sgl;
+    list_for_each_entry_safe(page, tmp, &pages, lru) {
+        sg_set_page(sg, page, page_size(page), 0);
+        sg = sg_next(sg);
+        list_del(&page->lru);
+    }
+
+    exp_info.ops = &hello_export_ops;
+    exp_info.size = exp->size;
+    exp_info.flags = O_RDWR;
+    exp_info.priv = exp;
+    dmabuf = dma_buf_export(&exp_info);
+    if (IS_ERR(dmabuf)) {
+        ret = PTR_ERR(dmabuf);
+        goto err_table;
+    }
+
+    return dmabuf;
+
+err_table:
+    for_each_sgtable_sg(&exp->sgt, sg, i)
+        hello_pool_free(sg_page(sg));
+    sg_free_table(&exp->sgt);
+    kfree(exp);
+    return ERR_PTR(ret);
+
+err_pages:
+    /* nothing was handed out yet, the pages are still zeroed */
+    list_for_each_entry_safe(page, tmp, &pages, lru) {
+        list_del(&page->lru);
+        hello_pool_free(page);
+    }
+    kfree(exp);
+    return ERR_PTR(ret);
+}
+
+static long hello_ioctl_alloc(struct hello_file *hfile, unsigned long arg)
+{
+    struct hello_alloc req;
+    struct dma_buf *dmabuf;
+    int fd;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)) != 0)
+        return -EFAULT;
+    if ((req.flags & ~HELLO_ALLOC_HUGE) || !req.size ||
+        req.size > totalram_pages() << PAGE_SHIFT)
+        return -EINVAL;
+
+    dmabuf = hello_export_alloc(req.size, req.flags);
+    if (IS_ERR(dmabuf))
+        return PTR_ERR(dmabuf);
+
+    /* only publish the fd once userspace is sure to learn its number */
+    fd = get_unused_fd_flags(O_CLOEXEC);
+    if (fd < 0) {
+        dma_buf_put(dmabuf);
+        return fd;
+    }
+
+    req.fd = fd;
+    req.size = dmabuf->size;
+    if (copy_to_user((void __user *)arg, &req, sizeof(req)) != 0) {
+        put_unused_fd(fd);
+        dma_buf_put(dmabuf);
+        return -EFAULT;
+    }
+
+    fd_install(fd, dmabuf->file);
+    return 0;
+}
+
+/*
+ * Userptr import: the user range is pinned and wrapped in a dma-buf of
+ * our own exporter, so everything downstream of the import path works on
+ * it unchanged. Mapped ranges stay cached per file until the handle or
+ * file goes away, or an mmu notifier says the range no longer maps the
+ * pinned pages. Then the cache drops its buffer and every handle of it is
+ * revoked, so the pages are unpinned as soon as operations still running
+ * on them finish; the next lookup pins the range again.
+ */
+#define HELLO_USERPTR_CACHE 16
+#define HELLO_USERPTR_RETRIES   3
+
+struct hello_userptr {
+    struct list_head node;
+    struct mmu_interval_notifier notifier;
+    struct hello_file *hfile;
+    struct dma_buf_dev *hdev;
+    unsigned long addr;
+    unsigned long size;
+    /*
+     * Holds a reference until the range is invalidated, NULL after that.
+     * Protected by hfile->userptr_lock.
+     */
+    struct hello_buf *buf;
+    /* notifier sequence the pages were pinned under */
+    unsigned long seq;
+    struct work_struct revoke_work;
+};
+
+static struct dma_buf *hello_export_userptr(unsigned long addr, unsigned long size)
+{
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    unsigned long npages = size >> PAGE_SHIFT;
+    struct hello_export *exp;
+    struct dma_buf *dmabuf;
+    int pinned, ret;
+
+    exp = kzalloc(sizeof(*exp), GFP_KERNEL);
+    if (!exp)
+        return ERR_PTR(-ENOMEM);
+
+    mutex_init(&exp->lock);
+    INIT_LIST_HEAD(&exp->attachments);
+    exp->size = size;
+
+    exp->upages = kvmalloc_array(npages, sizeof(*exp->upages), GFP_KERNEL);
+    if (!exp->upages) {
+        ret = -ENOMEM;
+        goto err_free;
+    }
+
+    pinned = pin_user_pages_fast(addr, npages, FOLL_WRITE | FOLL_LONGTERM,
+                                 exp->upages);
+    if (pinned != npages) {
+        ret = pinned < 0 ? pinned : -EFAULT;
+        if (pinned > 0)
+            unpin_user_pages(exp->upages, pinned);
+        goto err_pages;
+    }
+
+    /* contiguous pages, hugetlb in particular, end up in one entry */
+    ret = sg_alloc_table_from_pages(&exp->sgt, exp->upages, npages, 0, size,
+                                    GFP_KERNEL);
+    if (ret)
+        goto err_unpin;
+
+    exp_info.ops = &hello_export_ops;
+    exp_info.size = exp->size;
+    exp_info.flags = O_RDWR;
+    exp_info.priv = exp;
+    dmabuf = dma_buf_export(&exp_info);
+    if (IS_ERR(dmabuf)) {
+        ret = PTR_ERR(dmabuf);
+        goto err_table;
+    }
+
+    return dmabuf;
+
+err_table:
+    sg_free_table(&exp->sgt);
+err_unpin:
+    unpin_user_pages(exp->upages, npages);
+err_pages:
+    kvfree(exp->upages);
+err_free:
+    kfree(exp);
+    return ERR_PTR(ret);
+}
+
+/* replace every handle of buf with HELLO_HANDLE_REVOKED */
+static void hello_userptr_revoke_handles(struct hello_file *hfile, struct hello_buf *buf)
+{
+    struct hello_buf *entry;
+    unsigned long handle;
+
+    xa_for_each(&hfile->bufs, handle, entry) {
+        if (entry != buf)
+            continue;
+        if (xa_cmpxchg(&hfile->bufs, handle, buf, HELLO_HANDLE_REVOKED,
+                       GFP_KERNEL) == buf)
+            hello_buf_put(buf);
+    }
+}
+
+static void hello_userptr_revoke_work(struct work_struct *work)
+{
+    struct hello_userptr *up = container_of(work, struct hello_userptr, revoke_work);
+    struct hello_file *hfile = up->hfile;
+
+    mutex_lock(&hfile->userptr_lock);
+    /* also runs for the invalidations pinning itself caused, skip those */
+    if (up->buf && mmu_interval_check_retry(&up->notifier, up->seq)) {
+        hello_userptr_revoke_handles(hfile, up->buf);
+        hello_buf_put(up->buf);
+        up->buf = NULL;
+    }
+    mutex_unlock(&hfile->userptr_lock);
+}
+
+/*
+ * The range no longer maps the pinned pages. Unpinning needs locks that
+ * can't be taken here, so bump the sequence and leave the rest to a work
+ * item. Protection changes (fork's COW, mprotect, numa balancing) and
+ * soft-dirty clearing leave the pinned pages mapped, ignore those.
+ */
+static bool hello_userptr_invalidate(struct mmu_interval_notifier *mni,
+                                     const struct mmu_notifier_range *range,
+                                     unsigned long cur_seq)
+{
+    struct hello_userptr *up = container_of(mni, struct hello_userptr, notifier);
+
+    switch (range->event) {
+    case MMU_NOTIFY_PROTECTION_VMA:
+    case MMU_NOTIFY_PROTECTION_PAGE:
+    case MMU_NOTIFY_SOFT_DIRTY:
+        return true;
+    default:
+        break;
+    }
+
+    mmu_interval_set_seq(mni, cur_seq);
+    queue_work(hello_wq, &up->revoke_work);
+    return true;
+}
+
+static const struct mmu_interval_notifier_ops hello_userptr_notifier_ops = {
+    .invalidate = hello_userptr_invalidate,
+};
+
+static void hello_userptr_free(struct hello_userptr *up)
+{
+    /* no new invalidations once removed, then wait out a queued one */
+    mmu_interval_notifier_remove(&up->notifier);
+    cancel_work_sync(&up->revoke_work);
+    if (up->buf)
+        hello_buf_put(up->buf);
+    kfree(up);
+}
+
+/* called under userptr_lock, failed entries go to drop to be freed later */
+static struct hello_userptr *hello_userptr_create(struct hello_file *hfile,
+                                                  struct dma_buf_dev *hdev,
+                                                  unsigned long addr,
+                                                  unsigned long size,
+                                                  enum dma_data_direction dir,
+                                                  struct list_head *drop)
+{
+    struct hello_userptr *up;
+    struct dma_buf *dmabuf;
+    int tries = 0;
+    int ret;
+
+    up = kzalloc(sizeof(*up), GFP_KERNEL);
+    if (!up)
+        return ERR_PTR(-ENOMEM);
+
+    up->hfile = hfile;
+    up->hdev = hdev;
+    up->addr = addr;
+    up->size = size;
+    INIT_WORK(&up->revoke_work, hello_userptr_revoke_work);
+
+    /* watch the range before pinning so no invalidation slips through */
+    ret = mmu_interval_notifier_insert(&up->notifier, current->mm, addr, size,
+                                       &hello_userptr_notifier_ops);
+    if (ret)
+        goto err_free;
+
+    /* pinning for write may break cow and invalidate the range itself */
+    for (;;) {
+        up->seq = mmu_interval_read_begin(&up->notifier);
+        dmabuf = hello_export_userptr(addr, size);
+        if (IS_ERR(dmabuf)) {
+            ret = PTR_ERR(dmabuf);
+            goto err_remove;
+        }
+        if (!mmu_interval_check_retry(&up->notifier, up->seq))
+            break;
+        dma_buf_put(dmabuf);
+        if (++tries == HELLO_USERPTR_RETRIES) {
+            ret = -EAGAIN;
+            goto err_remove;
+        }
+    }
+
+    up->buf = hello_buf_attach(hdev, dmabuf, dir);
+    if (IS_ERR(up->buf)) {
+        ret = PTR_ERR(up->buf);
+        up->buf = NULL;
+        goto err_remove;
+    }
+
+    return up;
+
+err_remove:
+    /* a queued revoke may be waiting for userptr_lock, can't cancel it here */
+    list_add(&up->node, drop);
+    return ERR_PTR(ret);
+err_free:
+    kfree(up);
+    return ERR_PTR(ret);
+}
+
+/* a mapped buffer for [addr, addr + size) of the caller, cached per file */
+static struct hello_buf *hello_userptr_get(struct hello_file *hfile,
+                                           struct dma_buf_dev *hdev,
+                                           u64 addr, u64 size,
+                                           enum dma_data_direction dir)
+{
+    struct hello_userptr *up, *tmp, *found = NULL;
+    struct hello_buf *buf;
+    LIST_HEAD(drop);
+
+    if (!size || !PAGE_ALIGNED(addr) || !PAGE_ALIGNED(size) ||
+        size > totalram_pages() << PAGE_SHIFT || addr + size < addr)
+        return ERR_PTR(-EINVAL);
+
+    mutex_lock(&hfile->userptr_lock);
+    list_for_each_entry_safe(up, tmp, &hfile->userptrs, node) {
+        if (!up->buf || mmu_interval_check_retry(&up->notifier, up->seq)) {
+            /* the revoke work hasn't run yet, do its job now */
+            if (up->buf)
+                hello_userptr_revoke_handles(hfile, up->buf);
+            list_move(&up->node, &drop);
+            hfile->nr_userptrs--;
+            continue;
+        }
+        if (!found && up->hdev == hdev && up->notifier.mm == current->mm &&
+            up->addr == addr && up->size == size && up->buf->dir == dir)
+            found = up;
+    }
+
+    if (!found) {
+        found = hello_userptr_create(hfile, hdev, addr, size, dir, &drop);
+        if (IS_ERR(found)) {
+            buf = ERR_CAST(found);
+            goto out;
+        }
+        hfile->nr_userptrs++;
+        list_add(&found->node, &hfile->userptrs);
+    } else {
+        list_move(&found->node, &hfile->userptrs);
+    }
+
+    /*
+     * Evict the oldest entry nothing else holds. One with handles or
+     * operations on it has to keep watching its range, so with all of
+     * them busy the cache grows past the limit instead.
+     */
+    if (hfile->nr_userptrs > HELLO_USERPTR_CACHE) {
+        list_for_each_entry_reverse(up, &hfile->userptrs, node) {
+            if (up != found && kref_read(&up->buf->ref) == 1) {
+                list_move(&up->node, &drop);
+                hfile->nr_userptrs--;
+                break;
+            }
+        }
+    }
+
+    buf = found->buf;
+    kref_get(&buf->ref);
+out:
+    mutex_unlock(&hfile->userptr_lock);
+
+    list_for_each_entry_safe(up, tmp, &drop, node)
+        hello_userptr_free(up);
+
+    return buf;
+}
+
+static void hello_userptrs_release_all(struct hello_file *hfile)
+{
+    struct hello_userptr *up, *tmp;
+    LIST_HEAD(drop);
+
+    /* revoke work takes the lock, so free outside of it */
+    mutex_lock(&hfile->userptr_lock);
+    list_splice_init(&hfile->userptrs, &drop);
+    hfile->nr_userptrs = 0;
+    mutex_unlock(&hfile->userptr_lock);
+
+    list_for_each_entry_safe(up, tmp, &drop, node)
+        hello_userptr_free(up);
+}
+
+static long hello_ioctl_userptr(struct hello_file *hfile, unsigned long arg)
+{
+    struct hello_userptr_import req;
+    struct hello_userptr *up;
+    struct hello_buf *buf;
+    enum dma_data_direction dir;
+    u32 handle;
+    int ret;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)) != 0)
+        return -EFAULT;
+
+    ret = hello_dir_from_user(hfile->hdev, req.dir, &dir);
+    if (ret)
+        return ret;
+
+    buf = hello_userptr_get(hfile, hfile->hdev, req.addr, req.size, dir);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+
+    /* a revoke since the lookup would not have seen the new handle */
+    ret = -EAGAIN;
+    mutex_lock(&hfile->userptr_lock);
+    list_for_each_entry(up, &hfile->userptrs, node) {
+        if (up->buf == buf) {
+            ret = xa_alloc(&hfile->bufs, &handle, buf, xa_limit_32b, GFP_KERNEL);
+            break;
+        }
+    }
+    mutex_unlock(&hfile->userptr_lock);
+    if (ret < 0) {
+        hello_buf_put(buf);
+        return ret;
+    }
+
+    req.handle = handle;
+    if (copy_to_user((void __user *)arg, &req, sizeof(req)) != 0) {
+        /* may have been revoked already */
+        buf = xa_erase(&hfile->bufs, handle);
+        if (buf && !xa_is_value(buf))
+            hello_buf_put(buf);
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+/*
+ * Emulated dma engine. Each channel runs its descriptors in order with
+ * cpu copies against the mapped sg_tables, then pretends the transfer
+ * took length * dma_ns_per_kib / 1024 ns on a serial engine. Completion
+ * comes from an hrtimer, so fences signal from interrupt context the way
+ * a real engine's irq handler would.
+ */
+static unsigned int dma_channels = 2;
+module_param(dma_channels, uint, 0444);
+MODULE_PARM_DESC(dma_channels, "Number of emulated dma engine channels");
+
+static unsigned int dma_chan_depth = 32;
+module_param(dma_chan_depth, uint, 0644);
+MODULE_PARM_DESC(dma_chan_depth, "Descriptors a channel accepts before returning -EAGAIN");
+
+static unsigned int dma_ns_per_kib = 100;
+module_param(dma_ns_per_kib, uint, 0644);
+MODULE_PARM_DESC(dma_ns_per_kib, "Simulated transfer cost per KiB in ns, 100 is about 10 GB/s");
+
+struct hello_dma_chan {
+    unsigned int id;
+    spinlock_t lock;
+    /* submitted, not yet executed */
+    struct list_head queue;
+    /* executed, waiting for their completion interrupt */
+    struct list_head done;
+    /* descriptors between submit and completion */
+    unsigned int depth;
+    u64 context;
+    u64 seqno;
+    /* simulated time the engine finishes what it has been given */
+    ktime_t busy_until;
+    struct work_struct work;
+    struct hrtimer timer;
+    /* for the debugfs "dma" file */
+    u64 submitted;
+    u64 completed;
+    u64 failed;
+    u64 bytes;
+};
+
+struct hello_dma_desc {
+    struct dma_fence base;
+    struct list_head node;
+    struct hello_dma_chan *chan;
+    u32 op;
+    struct hello_buf *src;
+    struct hello_buf *dst;
+    u64 src_offset;
+    u64 dst_offset;
+    u64 length;
+    u8 value;
+    ktime_t due;
+};
+
+static struct hello_dma_chan *hello_dma_chans;
+
+static const char *hello_dma_fence_get_timeline_name(struct dma_fence *fence)
+{
+    return "hello_dma";
+}
+
+static void hello_dma_fence_release(struct dma_fence *fence)
+{
+    struct hello_dma_desc *desc = container_of(fence, struct hello_dma_desc, base);
+
+    kfree_rcu(desc, base.rcu);
+    module_put(THIS_MODULE);
+}
+
+static const struct dma_fence_ops hello_dma_fence_ops = {
+    .get_driver_name = hello_fence_get_driver_name,
+    .get_timeline_name = hello_dma_fence_get_timeline_name,
+    .release = hello_dma_fence_release,
+};
+
+/* the completion "interrupt": signal everything that is due */
+static enum hrtimer_restart hello_dma_chan_irq(struct hrtimer *timer)
+{
+    struct hello_dma_chan *c = container_of(timer, struct hello_dma_chan, timer);
+    struct hello_dma_desc *desc, *tmp;
+    enum hrtimer_restart restart = HRTIMER_NORESTART;
+    ktime_t now = ktime_get();
+    unsigned long flags;
+    LIST_HEAD(due);
+
+    spin_lock_irqsave(&c->lock, flags);
+    list_for_each_entry_safe(desc, tmp, &c->done, node) {
+        if (ktime_after(desc->due, now)) {
+            hrtimer_set_expires(timer, desc->due);
+            restart = HRTIMER_RESTART;
+            break;
+        }
+        list_move_tail(&desc->node, &due);
+        c->depth--;
+        c->completed++;
+    }
+    spin_unlock_irqrestore(&c->lock, flags);
+
+    list_for_each_entry_safe(desc, tmp, &due, node) {
+        list_del(&desc->node);
+        dma_fence_signal(&desc->base);
+        dma_fence_put(&desc->base);
+    }
+
+    return restart;
+}
+
+static int hello_dma_desc_exec(struct hello_dma_desc *desc)
+{
+    if (desc->op == HELLO_DMA_OP_FILL)
+        return hello_fill_range(desc->dst, desc->dst_offset, desc->length,
+                                desc->value);
+    return hello_copy_range(desc->dst, desc->dst_offset, desc->src,
+                            desc->src_offset, desc->length);
+}
+
+static void hello_dma_chan_work(struct work_struct *work)
+{
+    struct hello_dma_chan *c = container_of(work, struct hello_dma_chan, work);
+    struct hello_dma_desc *desc;
+    u64 cost;
+    bool arm;
+    int ret;
+
+    for (;;) {
+        spin_lock_irq(&c->lock);
+        desc = list_first_entry_or_null(&c->queue, struct hello_dma_desc, node);
+        if (desc)
+            list_del(&desc->node);
+        spin_unlock_irq(&c->lock);
+        if (!desc)
+            break;
+
+        ret = hello_dma_desc_exec(desc);
+        if (ret)
+            dma_fence_set_error(&desc->base, ret);
+
+        /* the engine only needs the buffers while it moves data */
+        if (desc->src)
+            hello_buf_put(desc->src);
+        hello_buf_put(desc->dst);
+        desc->src = desc->dst = NULL;
+
+        cost = div_u64(desc->length * READ_ONCE(dma_ns_per_kib), 1024);
+
+        spin_lock_irq(&c->lock);
+        c->busy_until = ktime_add_ns(ktime_after(c->busy_until, ktime_get()) ?
+                                     c->busy_until : ktime_get(), cost);
+        desc->due = c->busy_until;
+        if (ret)
+            c->failed++;
+        else
+            c->bytes += desc->length;
+        arm = list_empty(&c->done);
+        list_add_tail(&desc->node, &c->done);
+        if (arm)
+            hrtimer_start(&c->timer, desc->due, HRTIMER_MODE_ABS);
+        spin_unlock_irq(&c->lock);
+
+        cond_resched();
+    }
+}
+
+/* the requested channel, or the least busy one */
+static struct hello_dma_chan *hello_dma_pick_chan(u32 id)
+{
+    struct hello_dma_chan *c, *best = NULL;
+    unsigned int i;
+
+    if (id != HELLO_DMA_ANY_CHANNEL)
+        return id < dma_channels ? &hello_dma_chans[id] : NULL;
+
+    for (i = 0; i < dma_channels; i++) {
+        c = &hello_dma_chans[i];
+        if (!best || READ_ONCE(c->depth) < READ_ONCE(best->depth))
+            best = c;
+    }
+    return best;
+}
+
+static int hello_dma_desc_init(struct hello_file *hfile, struct hello_dma_desc *desc,
+                               struct hello_dma *req)
+{
+    int ret;
+
+    desc->op = req->op;
+    desc->src_offset = req->src_offset;
+    desc->dst_offset = req->dst_offset;
+    desc->value = req->pattern;
+
+    desc->dst = hello_buf_lookup(hfile, req->dst);
+    if (!desc->dst)
+        return -EINVAL;
+    ret = hello_buf_check_write(desc->dst);
+    if (ret)
+        return ret;
+
+    if (req->op == HELLO_DMA_OP_COPY) {
+        desc->src = hello_buf_lookup(hfile, req->src);
+        if (!desc->src)
+            return -EINVAL;
+        ret = hello_copy_check(desc->dst, req->dst_offset, desc->src,
+                               req->src_offset, &req->length);
+    } else {
+        ret = hello_buf_check_range(desc->dst, req->dst_offset, &req->length);
+    }
+    if (ret)
+        return ret;
+
+    desc->length = req->length;
+    return 0;
+}
+
+static long hello_ioctl_dma(struct hello_file *hfile, unsigned long arg)
+{
+    struct hello_dma req;
+    struct hello_dma_desc *desc;
+    struct hello_dma_chan *c;
+    struct sync_file *sync;
+    int fd, ret;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)) != 0)
+        return -EFAULT;
+    if (req.flags || req.op > HELLO_DMA_OP_FILL)
+        return -EINVAL;
+
+    c = hello_dma_pick_chan(req.channel);
+    if (!c)
+        return -EINVAL;
+
+    desc = kzalloc(sizeof(*desc), GFP_KERNEL);
+    if (!desc)
+        return -ENOMEM;
+
+    ret = hello_dma_desc_init(hfile, desc, &req);
+    if (ret)
+        goto err_bufs;
+
+    spin_lock_irq(&c->lock);
+    if (c->depth >= READ_ONCE(dma_chan_depth)) {
+        spin_unlock_irq(&c->lock);
+        ret = -EAGAIN;
+        goto err_bufs;
+    }
+    c->depth++;
+    spin_unlock_irq(&c->lock);
+    desc->chan = c;
+
+    fd = get_unused_fd_flags(O_CLOEXEC);
+    if (fd < 0) {
+        ret = fd;
+        goto err_depth;
+    }
+
+    req.fence_fd = fd;
+    req.channel = c->id;
+    if (copy_to_user((void __user *)arg, &req, sizeof(req)) != 0) {
+        ret = -EFAULT;
+        goto err_fd;
+    }
+
+    /*
+     * Nothing can fail the submission between taking the seqno and
+     * queueing, so seqnos on a channel's timeline never go backwards.
+     */
+    spin_lock_irq(&c->lock);
+    /* dropped in hello_dma_fence_release, like for submitted jobs */
+    __module_get(THIS_MODULE);
+    /* in order per channel, so one timeline each */
+    dma_fence_init(&desc->base, &hello_dma_fence_ops, &c->lock, c->context,
+                   ++c->seqno);
+    dma_fence_get(&desc->base);
+    list_add_tail(&desc->node, &c->queue);
+    c->submitted++;
+    spin_unlock_irq(&c->lock);
+    queue_work(hello_wq, &c->work);
+
+    /* the transfer is queued and runs either way, only the fd is lost */
+    sync = sync_file_create(&desc->base);
+    dma_fence_put(&desc->base);
+    if (!sync) {
+        put_unused_fd(fd);
+        return -ENOMEM;
+    }
+
+    fd_install(fd, sync->file);
+
+    return 0;
+
+err_fd:
+    put_unused_fd(fd);
+err_depth:
+    spin_lock_irq(&c->lock);
+    c->depth--;
+    spin_unlock_irq(&c->lock);
+err_bufs:
+    if (desc->src)
+        hello_buf_put(desc->src);
+    if (desc->dst)
+        hello_buf_put(desc->dst);
+    kfree(desc);
+    return ret;
+}
+
+static int hello_dma_show(struct seq_file *m, void *unused)
+{
+    struct hello_dma_chan *c;
+    unsigned int i;
+
+    seq_puts(m, "chan     depth  submitted  completed     failed        bytes\n");
+    for (i = 0; i < dma_channels; i++) {
+        c = &hello_dma_chans[i];
+        spin_lock_irq(&c->lock);
+        seq_printf(m, "%-4u %10u %10llu %10llu %10llu %12llu\n", c->id,
+                   c->depth, c->submitted, c->completed, c->failed, c->bytes);
+        spin_unlock_irq(&c->lock);
+    }
+
+    return 0;
+}
+
+static int hello_dma_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hello_dma_show, NULL);
+}
+
+static const struct file_operations hello_dma_fops = {
+    .owner = THIS_MODULE,
+    .open = hello_dma_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int hello_dma_init(void)
+{
+    struct hello_dma_chan *c;
+    unsigned int i;
+
+    if (!dma_channels)
+        return -EINVAL;
+
+    hello_dma_chans = kcalloc(dma_channels, sizeof(*hello_dma_chans), GFP_KERNEL);
+    if (!hello_dma_chans)
+        return -ENOMEM;
+
+    for (i = 0; i < dma_channels; i++) {
+        c = &hello_dma_chans[i];
+        c->id = i;
+        spin_lock_init(&c->lock);
+        INIT_LIST_HEAD(&c->queue);
+        INIT_LIST_HEAD(&c->done);
+        c->context = dma_fence_context_alloc(1);
+        INIT_WORK(&c->work, hello_dma_chan_work);
+        hrtimer_init(&c->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+        c->timer.function = hello_dma_chan_irq;
+    }
+
+    return 0;
+}
+
+/* after hello_wq is drained, nothing is left to execute, only to complete */
+static void hello_dma_exit(void)
+{
+    struct hello_dma_desc *desc, *tmp;
+    struct hello_dma_chan *c;
+    unsigned int i;
+
+    for (i = 0; i < dma_channels; i++) {
+        c = &hello_dma_chans[i];
+        hrtimer_cancel(&c->timer);
+        list_for_each_entry_safe(desc, tmp, &c->done, node) {
+            list_del(&desc->node);
+            dma_fence_signal(&desc->base);
+            dma_fence_put(&desc->base);
+        }
+    }
+    kfree(hello_dma_chans);
+}
+
+/*
+ * Shared submission and completion rings. Userspace mmaps them from the
+ * device fd, writes sqes and moves sq_tail, then rings the doorbell or
+ * lets the sqpoll thread notice. Entries are consumed in order by exactly
+ * one context, the doorbell work item or the sqpoll thread, and each one
+ * posts a cqe carrying the sqe's sequence number.
+ */
+#define HELLO_RING_IDLE_MS  10
+
+struct hello_ring {
+    struct hello_file *hfile;
+    /* vmalloc_user memory behind the mmap */
+    void *mem;
+    size_t mmap_size;
+    struct hello_ring_hdr *hdr;
+    struct hello_sqe *sqes;
+    struct hello_cqe *cqes;
+    u32 sq_entries;
+    u32 cq_entries;
+    /* private copies, userspace may scribble over the shared header */
+    u32 sq_head;
+    u32 cq_tail;
+    struct work_struct work;
+    struct task_struct *sqpoll;
+    unsigned long idle;
 };
 
+static int hello_ring_exec(struct hello_file *hfile, const struct hello_sqe *sqe)
+{
+    struct hello_buf *buf, *src;
+    u64 length = sqe->length;
+    int ret;
+
+    if (sqe->flags)
+        return -EINVAL;
+    if (sqe->op == HELLO_OP_NOP)
+        return 0;
+
+    buf = hello_buf_lookup(hfile, sqe->handle);
+    if (!buf)
+        return -EINVAL;
+
+    switch (sqe->op) {
+    case HELLO_OP_SUBMIT:
+        ret = hello_buf_check_range(buf, sqe->offset, &length);
+        if (!ret)
+            ret = hello_buf_process(buf, sqe->offset, length);
+        break;
+    case HELLO_OP_COPY:
+        src = hello_buf_lookup(hfile, sqe->src);
+        if (!src) {
+            ret = -EINVAL;
+            break;
+        }
+        ret = hello_copy_check(buf, sqe->offset, src, sqe->src_offset, &length);
+        if (!ret)
+            ret = hello_copy_range(buf, sqe->offset, src, sqe->src_offset, length);
+        hello_buf_put(src);
+        break;
+    case HELLO_OP_FILL:
+        ret = hello_buf_check_range(buf, sqe->offset, &length);
+        if (!ret)
+            ret = hello_fill_range(buf, sqe->offset, length, sqe->pattern);
+        break;
+    default:
+        ret = -EINVAL;
+    }
+
+    hello_buf_put(buf);
+    return ret;
+}
+
+static bool hello_ring_cq_full(struct hello_ring *ring)
+{
+    return ring->cq_tail - smp_load_acquire(&ring->hdr->cq_head) >= ring->cq_entries;
+}
+
+/* returns the number of sqes consumed, stops early while the cq is full */
+static unsigned int hello_ring_consume(struct hello_ring *ring)
+{
+    struct hello_ring_hdr *hdr = ring->hdr;
+    struct hello_cqe *cqe;
+    struct hello_sqe sqe;
+    unsigned int done = 0;
+    u32 tail;
+
+    tail = smp_load_acquire(&hdr->sq_tail);
+    /* a bogus tail only gets one lap of the ring per call */
+    if (tail - ring->sq_head > ring->sq_entries)
+        tail = ring->sq_head + ring->sq_entries;
+
+    while (ring->sq_head != tail) {
+        if (hello_ring_cq_full(ring))
+            break;
+
+        /* copy it out first, userspace can rewrite the slot at any time */
+        memcpy(&sqe, &ring->sqes[ring->sq_head & (ring->sq_entries - 1)], sizeof(sqe));
+        ring->sq_head++;
+        smp_store_release(&hdr->sq_head, ring->sq_head);
+
+        cqe = &ring->cqes[ring->cq_tail & (ring->cq_entries - 1)];
+        cqe->user_data = sqe.user_data;
+        cqe->seq = ring->sq_head - 1;
+        cqe->res = hello_ring_exec(ring->hfile, &sqe);
+        ring->cq_tail++;
+        smp_store_release(&hdr->cq_tail, ring->cq_tail);
+
+        done++;
+        cond_resched();
+    }
+
+    if (done)
+        wake_up_interruptible(&ring->hfile->wait);
+    return done;
+}
+
+static void hello_ring_work(struct work_struct *work)
+{
+    struct hello_ring *ring = container_of(work, struct hello_ring, work);
+
+    while (hello_ring_consume(ring))
+        ;
+}
+
+/*
+ * Busy polls the sq for ring->idle jiffies after the last sqe, then sets
+ * HELLO_SQ_NEED_WAKEUP and sleeps until the doorbell wakes it. A full cq
+ * sends it to sleep right away, userspace kicks it after reaping.
+ */
+static int hello_ring_sqpoll(void *data)
+{
+    struct hello_ring *ring = data;
+    struct hello_ring_hdr *hdr = ring->hdr;
+    unsigned long timeout = jiffies + ring->idle;
+
+    while (!kthread_should_stop()) {
+        if (hello_ring_consume(ring)) {
+            timeout = jiffies + ring->idle;
+            continue;
+        }
+        if (!hello_ring_cq_full(ring) && time_before(jiffies, timeout)) {
+            cond_resched();
+            continue;
+        }
+
+        set_current_state(TASK_INTERRUPTIBLE);
+        WRITE_ONCE(hdr->sq_flags, HELLO_SQ_NEED_WAKEUP);
+        /*
+         * Pairs with userspace storing sq_tail or cq_head before it reads
+         * sq_flags.
+         */
+        smp_mb();
+        if ((READ_ONCE(hdr->sq_tail) == ring->sq_head || hello_ring_cq_full(ring)) &&
+            !kthread_should_stop())
+            schedule();
+        __set_current_state(TASK_RUNNING);
+        WRITE_ONCE(hdr->sq_flags, 0);
+        timeout = jiffies + ring->idle;
+    }
+
+    return 0;
+}
+
+static void hello_ring_destroy(struct hello_ring *ring)
+{
+    if (ring->sqpoll)
+        kthread_stop(ring->sqpoll);
+    else
+        cancel_work_sync(&ring->work);
+    vfree(ring->mem);
+    kfree(ring);
+}
+
+static long hello_ioctl_ring_setup(struct hello_file *hfile, unsigned long arg)
+{
+    struct hello_ring_setup req;
+    struct hello_ring *ring;
+    size_t sq_off, cq_off;
+    long ret;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)) != 0)
+        return -EFAULT;
+    if ((req.flags & ~HELLO_RING_SQPOLL) || !req.sq_entries ||
+        req.sq_entries > HELLO_RING_MAX_ENTRIES ||
+        req.cq_entries > 2 * HELLO_RING_MAX_ENTRIES ||
+        req.sq_idle_ms > HELLO_RING_MAX_IDLE_MS)
+        return -EINVAL;
+    if (READ_ONCE(hfile->ring))
+        return -EBUSY;
+
+    ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+    if (!ring)
+        return -ENOMEM;
+
+    ring->hfile = hfile;
+    ring->sq_entries = roundup_pow_of_two(req.sq_entries);
+    ring->cq_entries = roundup_pow_of_two(req.cq_entries ? : 2 * req.sq_entries);
+    if (ring->cq_entries < ring->sq_entries) {
+        ret = -EINVAL;
+        goto err_free;
+    }
+
+    sq_off = ALIGN(sizeof(struct hello_ring_hdr), sizeof(struct hello_sqe));
+    cq_off = ALIGN(sq_off + ring->sq_entries * sizeof(struct hello_sqe),
+                   sizeof(struct hello_cqe));
+    ring->mmap_size = PAGE_ALIGN(cq_off + ring->cq_entries * sizeof(struct hello_cqe));
+
+    ring->mem = vmalloc_user(ring->mmap_size);
+    if (!ring->mem) {
+        ret = -ENOMEM;
+        goto err_free;
+    }
+    ring->hdr = ring->mem;
+    ring->sqes = ring->mem + sq_off;
+    ring->cqes = ring->mem + cq_off;
+    ring->hdr->sq_mask = ring->sq_entries - 1;
+    ring->hdr->cq_mask = ring->cq_entries - 1;
+
+    INIT_WORK(&ring->work, hello_ring_work);
+    if (req.flags & HELLO_RING_SQPOLL) {
+        ring->idle = msecs_to_jiffies(req.sq_idle_ms ? : HELLO_RING_IDLE_MS);
+        ring->sqpoll = kthread_create(hello_ring_sqpoll, ring, "hello_sqpoll");
+        if (IS_ERR(ring->sqpoll)) {
+            ret = PTR_ERR(ring->sqpoll);
+            goto err_vfree;
+        }
+    }
+
+    req.sq_entries = ring->sq_entries;
+    req.cq_entries = ring->cq_entries;
+    req.mmap_size = ring->mmap_size;
+    req.sq_off = sq_off;
+    req.cq_off = cq_off;
+    if (copy_to_user((void __user *)arg, &req, sizeof(req)) != 0) {
+        ret = -EFAULT;
+        goto err_thread;
+    }
 
-static struct dma_buf_dev test_devA;
-static struct dma_buf_dev test_devB;
+    if (cmpxchg(&hfile->ring, NULL, ring)) {
+        ret = -EBUSY;
+        goto err_thread;
+    }
+    if (ring->sqpoll)
+        wake_up_process(ring->sqpoll);
 
-static int hello_open(struct inode* inode, struct file* file) {
-    pr_info("hello_open 3\n");
     return 0;
+
+err_thread:
+    if (ring->sqpoll)
+        kthread_stop(ring->sqpoll);
+err_vfree:
+    vfree(ring->mem);
+err_free:
+    kfree(ring);
+    return ret;
 }
 
-static int hello_close(struct inode* inode, struct file* file) {
-    pr_info("hello_close 3\n");
+/* the doorbell: make the kernel look at the sq again */
+static long hello_ioctl_ring_kick(struct hello_file *hfile)
+{
+    struct hello_ring *ring = READ_ONCE(hfile->ring);
+
+    if (!ring)
+        return -ENXIO;
+
+    if (ring->sqpoll)
+        wake_up_process(ring->sqpoll);
+    else
+        queue_work(hello_wq, &ring->work);
+
     return 0;
 }
 
-static long hello_ioctl(struct file *file, unsigned cmd, unsigned long arg)
+static bool hello_ring_cq_ready(struct hello_file *hfile)
+{
+    struct hello_ring *ring = READ_ONCE(hfile->ring);
+
+    return ring && READ_ONCE(ring->hdr->cq_head) != READ_ONCE(ring->cq_tail);
+}
+
+/* the ring header, sqes and cqes, all in one mapping at offset 0 */
+static int hello_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct hello_file *hfile = file->private_data;
+    struct hello_ring *ring = READ_ONCE(hfile->ring);
+
+    if (!ring)
+        return -ENXIO;
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > ring->mmap_size)
+        return -EINVAL;
+
+    return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
+/*
+ * TEST_DRIVERA/TEST_DRIVERB: one-shot import, write the device string and
+ * drop everything again. All state is on the stack so concurrent callers
+ * don't trample each other. A negative fd selects the user memory at
+ * buf/size instead, whose pinned mapping is cached by the file.
+ */
+static long hello_ioctl_oneshot(struct hello_file *hfile, struct dma_buf_dev *hdev,
+                                unsigned long arg)
 {
-    int i;
     struct buf_info info;
-    struct scatterlist *sg;
+    struct hello_buf *buf;
+    struct sg_table *sgt;
+    void *vaddr;
+    int ret;
 
     if (copy_from_user(&info, (void __user *)arg, sizeof(info)) != 0) {
         pr_info("copy_from_user failed\n");
         return -EFAULT;
     }
-    pr_info("fd[%d], buf[0x%px], size[0x%x]\n", info.fd, info.buf, info.size);
+    dev_dbg(hdev->dev, "fd[%d], buf[0x%px], size[0x%x]\n", info.fd, info.buf, info.size);
+
+    /* for dma access */
+    if (info.fd < 0) {
+        buf = hello_userptr_get(hfile, hdev, (unsigned long)info.buf, info.size,
+                                hdev->dir);
+        if (IS_ERR(buf))
+            return PTR_ERR(buf);
+    } else {
+        buf = hello_buf_import(hdev, info.fd, hdev->dir);
+        if (IS_ERR(buf))
+            return -EBUSY;
+    }
+
+    /* for cpu access, synced only the way the device's mapping needs it */
+    sgt = hello_buf_pin_sgt(buf);
+    if (IS_ERR(sgt)) {
+        ret = PTR_ERR(sgt);
+        goto put;
+    }
+    vaddr = hello_buf_vaddr(buf);
+    if (!vaddr) {
+        ret = -ENOMEM;
+        goto unpin;
+    }
+    ret = hello_buf_begin_cpu(buf, buf->dir, 0, buf->dma_buf->size);
+    if (ret)
+        goto unpin;
+    dev_dbg(hdev->dev, "<%s: %d>addr = 0x%px, str = %s\n",
+           __FUNCTION__, __LINE__, vaddr, (char *)vaddr);
+    strcpy((char *)vaddr, hdev->str);
+    hello_buf_end_cpu(buf, buf->dir, 0, buf->dma_buf->size);
+
+unpin:
+    hello_buf_unpin_sgt(buf);
+put:
+    hello_buf_put(buf);
+    return ret;
+}
+
+static int hello_open(struct inode *inode, struct file *file)
+{
+    struct hello_file *hfile;
+
+    hfile = kzalloc(sizeof(*hfile), GFP_KERNEL);
+    if (!hfile)
+        return -ENOMEM;
 
-    switch(cmd) {
+    kref_init(&hfile->ref);
+    hfile->hdev = hello_inode_to_dev(inode, file);
+    xa_init_flags(&hfile->bufs, XA_FLAGS_ALLOC1);
+    atomic_set(&hfile->inflight, 0);
+    init_waitqueue_head(&hfile->wait);
+    mutex_init(&hfile->userptr_lock);
+    INIT_LIST_HEAD(&hfile->userptrs);
+    file->private_data = hfile;
+
+    return 0;
+}
+
+static int hello_close(struct inode *inode, struct file *file)
+{
+    struct hello_file *hfile = file->private_data;
+
+    /* the ring executes on this file's buffers, stop it first */
+    if (hfile->ring)
+        hello_ring_destroy(hfile->ring);
+    /* queued jobs hold their own buf and file references */
+    hello_userptrs_release_all(hfile);
+    hello_bufs_release_all(hfile);
+    hello_file_put(hfile);
+
+    return 0;
+}
+
+/*
+ * Readable once every async submission has signalled, or while the
+ * completion ring has cqes to reap.
+ */
+static __poll_t hello_poll(struct file *file, poll_table *wait)
+{
+    struct hello_file *hfile = file->private_data;
+    __poll_t mask = 0;
+    int inflight;
+
+    poll_wait(file, &hfile->wait, wait);
+
+    /* with a ring, readable means cqes to reap rather than idle */
+    inflight = atomic_read(&hfile->inflight);
+    if (READ_ONCE(hfile->ring) ? hello_ring_cq_ready(hfile) : !inflight)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (inflight < HELLO_MAX_INFLIGHT)
+        mask |= EPOLLOUT | EPOLLWRNORM;
+
+    return mask;
+}
+
+static long hello_ioctl(struct file *file, unsigned cmd, unsigned long arg)
+{
+    struct hello_file *hfile = file->private_data;
+
+    switch (cmd) {
     case TEST_DRIVERA:
-        /* for dma access */
-        test_devA.dma_buf = dma_buf_get(info.fd);
-        if (IS_ERR_OR_NULL(test_devA.dma_buf)) {
-            pr_info("Error! failed to get dma buf");
-		    return -EBUSY;
-        }
-        test_devA.attach = dma_buf_attach(test_devA.dma_buf, test_devA.dev);
-        if (IS_ERR_OR_NULL(test_devA.attach)) {
-            pr_info("Error! failed to attach dma buf");
-		    return -EBUSY;
-        }
-        test_devA.sg = dma_buf_map_attachment(test_devA.attach, DMA_BIDIRECTIONAL);
-        if (IS_ERR_OR_NULL(test_devA.sg)) {
-            pr_info("Error! failed to map attached dma buf");
-		    return -EBUSY;
+        return hello_ioctl_oneshot(hfile, &hello_devs[0], arg);
+    case TEST_DRIVERB:
+        if (ndevs < 2)
+            return -ENODEV;
+        return hello_ioctl_oneshot(hfile, &hello_devs[1], arg);
+    case TEST_DRIVER_IMPORT:
+        return hello_ioctl_import(hfile, arg);
+    case TEST_DRIVER_RELEASE:
+        return hello_ioctl_release(hfile, arg);
+    case TEST_DRIVER_SUBMIT:
+        return hello_ioctl_submit(hfile, arg);
+    case TEST_DRIVER_BATCH:
+        return hello_ioctl_batch(hfile, arg);
+    case TEST_DRIVER_ALLOC:
+        return hello_ioctl_alloc(hfile, arg);
+    case TEST_DRIVER_COPY:
+        return hello_ioctl_copy(hfile, arg);
+    case TEST_DRIVER_QUERY_SG:
+        return hello_ioctl_query_sg(hfile, arg);
+    case TEST_DRIVER_USERPTR:
+        return hello_ioctl_userptr(hfile, arg);
+    case TEST_DRIVER_DMA:
+        return hello_ioctl_dma(hfile, arg);
+    case TEST_DRIVER_RING_SETUP:
+        return hello_ioctl_ring_setup(hfile, arg);
+    case TEST_DRIVER_RING_KICK:
+        return hello_ioctl_ring_kick(hfile);
+    case TEST_DRIVER_PATTERN:
+        return hello_ioctl_pattern(hfile, arg);
+    case TEST_DRIVER_CHECKSUM:
+        return hello_ioctl_checksum(hfile, arg);
+    case TEST_DRIVER_CHAIN:
+        return hello_ioctl_chain(hfile, arg);
+    }
+
+    return -ENOTTY;
+}
+
+static int hello_stats_show(struct seq_file *m, void *unused)
+{
+    struct dma_buf_dev *hdev = m->private;
+    u64 count, total, hist[HELLO_HIST_BUCKETS];
+    struct hello_stats *st;
+    int cpu, phase, b;
+
+    for (phase = 0; phase < HELLO_NR_PHASES; phase++) {
+        count = 0;
+        total = 0;
+        memset(hist, 0, sizeof(hist));
+        for_each_possible_cpu(cpu) {
+            st = per_cpu_ptr(hdev->stats, cpu);
+            count += st->count[phase];
+            total += st->total_ns[phase];
+            for (b = 0; b < HELLO_HIST_BUCKETS; b++)
+                hist[b] += st->hist[phase][b];
         }
 
-        for_each_sg(test_devA.sg->sgl, sg, test_devA.sg->nents, i) {
-            pr_info("<%s: %d>addr = 0x%08llx, len = 0x%x\n",
-                   __FUNCTION__, __LINE__, sg->dma_address, sg->length);
+        seq_printf(m, "%-7s count %llu total_ns %llu avg_ns %llu\n",
+                   hello_phase_names[phase], count, total,
+                   count ? div64_u64(total, count) : 0);
+        for (b = 0; b < HELLO_HIST_BUCKETS; b++) {
+            if (hist[b])
+                seq_printf(m, "  < 2^%-2d ns %llu\n", b, hist[b]);
         }
+    }
 
-        dma_buf_unmap_attachment(test_devA.attach, test_devA.sg, DMA_BIDIRECTIONAL);
-        dma_buf_detach(test_devA.dma_buf, test_devA.attach);
-        dma_buf_put(test_devA.dma_buf);
+    count = 0;
+    total = 0;
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(hdev->stats, cpu);
+        count += st->bounced;
+        total += st->bounced_bytes;
+    }
+    seq_printf(m, "bounced count %llu bytes %llu\n", count, total);
 
-        /* for cpu access */
-        test_devA.vaddr = dma_buf_vmap(test_devA.dma_buf);
-        pr_info("<%s: %d>addr = 0x%px, str = %s\n",
-               __FUNCTION__, __LINE__, test_devA.vaddr, (char *)test_devA.vaddr);
-        strcpy((char *)test_devA.vaddr, "driverA kernel space!");
-        dma_buf_vunmap(test_devA.dma_buf, test_devA.vaddr);
+    count = 0;
+    for_each_possible_cpu(cpu)
+        count += per_cpu_ptr(hdev->stats, cpu)->moved;
+    seq_printf(m, "moved   count %llu\n", count);
 
-        break;
+    return 0;
+}
 
-    case TEST_DRIVERB:
-        /* for dma access */
-        test_devB.dma_buf = dma_buf_get(info.fd);
-        test_devB.attach = dma_buf_attach(test_devB.dma_buf, test_devB.dev);
-        test_devB.sg = dma_buf_map_attachment(test_devB.attach, DMA_TO_DEVICE);
+static int hello_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hello_stats_show, inode->i_private);
+}
 
-        for_each_sg(test_devB.sg->sgl, sg, test_devB.sg->nents, i) {
-            pr_info("<%s: %d>addr = 0x%08llx, len = 0x%x\n",
-                   __FUNCTION__, __LINE__, sg->dma_address, sg->length);
-        }
+static const struct file_operations hello_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = hello_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
 
-        dma_buf_unmap_attachment(test_devB.attach, test_devB.sg, DMA_TO_DEVICE);
-        dma_buf_detach(test_devB.dma_buf, test_devB.attach);
-        dma_buf_put(test_devB.dma_buf);
+/* any write clears the counters of the device */
+static ssize_t hello_stats_reset_write(struct file *file, const char __user *ubuf,
+                                       size_t count, loff_t *ppos)
+{
+    struct dma_buf_dev *hdev = file->private_data;
+    int cpu;
 
-        /* for cpu access */
-        test_devB.vaddr = dma_buf_vmap(test_devB.dma_buf);
-        pr_info("<%s: %d>addr = 0x%px, str = %s\n",
-               __FUNCTION__, __LINE__, test_devB.vaddr, (char *)test_devB.vaddr);
-        strcpy((char *)test_devB.vaddr, "driverB kernel space!");
-        dma_buf_vunmap(test_devB.dma_buf, test_devB.vaddr);
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(hdev->stats, cpu), 0, sizeof(struct hello_stats));
 
-        break;
+    return count;
+}
+
+static const struct file_operations hello_stats_reset_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .write = hello_stats_reset_write,
+    .llseek = noop_llseek,
+};
+
+/* one letter per device in the node names */
+#define HELLO_MAX_DEVS  26
+
+static unsigned int dma_bits[HELLO_MAX_DEVS];
+static int nr_dma_bits;
+module_param_array(dma_bits, uint, &nr_dma_bits, 0444);
+MODULE_PARM_DESC(dma_bits, "DMA mask width per device, 64 if not given");
+
+static int hello_queues_show(struct seq_file *m, void *unused)
+{
+    struct hello_queue *q;
+    int cpu;
+
+    seq_puts(m, "cpu      depth  max_depth     queued   executed     stolen\n");
+    for_each_possible_cpu(cpu) {
+        q = per_cpu_ptr(hello_queues, cpu);
+        seq_printf(m, "%-4d %10u %10u %10llu %10llu %10llu\n", cpu,
+                   READ_ONCE(q->depth), q->max_depth, q->queued,
+                   q->executed, q->stolen);
+    }
+
+    return 0;
+}
+
+static int hello_queues_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hello_queues_show, NULL);
+}
+
+static const struct file_operations hello_queues_fops = {
+    .owner = THIS_MODULE,
+    .open = hello_queues_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/*
+ * Per-device setup shared by every registration flavour. Device 0 keeps
+ * the bidirectional mapping of the old driverA, the rest map to device
+ * like driverB did.
+ */
+static int hello_dev_init(struct dma_buf_dev *hdev, unsigned int idx)
+{
+    snprintf(hdev->name, sizeof(hdev->name), "cdriver%c", 'A' + idx);
+    snprintf(hdev->str, sizeof(hdev->str), "driver%c kernel space!", 'A' + idx);
+    hdev->dir = idx ? DMA_TO_DEVICE : DMA_BIDIRECTIONAL;
+
+    hdev->stats = alloc_percpu(struct hello_stats);
+    if (!hdev->stats)
+        return -ENOMEM;
+
+    hdev->debugfs = debugfs_create_dir(hdev->name, hello_debugfs_root);
+    debugfs_create_file("stats", 0444, hdev->debugfs, hdev, &hello_stats_fops);
+    debugfs_create_file("reset", 0200, hdev->debugfs, hdev, &hello_stats_reset_fops);
+
+    return 0;
+}
+
+/*
+ * Called once the struct device exists. Asks for the configured mask and
+ * falls back to 32 bits where the platform can't do it, anything above
+ * the final mask gets bounced and shows up in the stats.
+ */
+static int hello_dev_setup_dma(struct dma_buf_dev *hdev, unsigned int idx)
+{
+    unsigned int bits = dma_bits[idx] ? dma_bits[idx] : 64;
+    int ret;
+
+    if (bits < 32 || bits > 64)
+        return -EINVAL;
+
+    hdev->dev->dma_mask = &hdev->dma_mask;
+    ret = dma_set_mask_and_coherent(hdev->dev, DMA_BIT_MASK(bits));
+    if (ret && bits > 32) {
+        dev_info(hdev->dev, "%u bit dma not supported, using 32\n", bits);
+        ret = dma_set_mask_and_coherent(hdev->dev, DMA_BIT_MASK(32));
+    }
+    if (ret)
+        return ret;
+
+    debugfs_create_x64("dma_mask", 0444, hdev->debugfs, &hdev->dma_mask);
+    return 0;
+}
+
+static void hello_dev_exit(struct dma_buf_dev *hdev)
+{
+    debugfs_remove_recursive(hdev->debugfs);
+    hdev->debugfs = NULL;
+    free_percpu(hdev->stats);
+    hdev->stats = NULL;
+}
+
+static int hello_core_init(void)
+{
+    struct hello_queue *q;
+    int i, cpu, ret;
+
+    if (!ndevs || ndevs > HELLO_MAX_DEVS)
+        return -EINVAL;
+
+    spin_lock_init(&hello_pool.lock);
+    for (i = 0; i < HELLO_POOL_NR_ORDERS; i++)
+        INIT_LIST_HEAD(&hello_pool.items[i]);
+
+    hello_queues = alloc_percpu(struct hello_queue);
+    if (!hello_queues)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu) {
+        q = per_cpu_ptr(hello_queues, cpu);
+        spin_lock_init(&q->lock);
+        INIT_LIST_HEAD(&q->jobs);
+        q->cpu = cpu;
+        INIT_WORK(&q->work, hello_queue_work);
+    }
+
+    hello_wq = alloc_workqueue("hello", WQ_UNBOUND, 0);
+    if (!hello_wq) {
+        ret = -ENOMEM;
+        goto err_queues;
+    }
+
+    /* bound, so a queue's worker runs on the cpu that owns it */
+    hello_sq_wq = alloc_workqueue("hello_sq", 0, 0);
+    if (!hello_sq_wq) {
+        ret = -ENOMEM;
+        goto err_wq;
+    }
+
+    /* chunks of one request, unbound so they spread over the socket */
+    hello_par_wq = alloc_workqueue("hello_par", WQ_UNBOUND, 0);
+    if (!hello_par_wq) {
+        ret = -ENOMEM;
+        goto err_sq_wq;
     }
 
+    ret = hello_dma_init();
+    if (ret)
+        goto err_par_wq;
+
+    ret = register_shrinker(&hello_pool_shrinker);
+    if (ret)
+        goto err_dma;
+
+    hello_debugfs_root = debugfs_create_dir("hello", NULL);
+    debugfs_create_file("queues", 0444, hello_debugfs_root, NULL, &hello_queues_fops);
+    debugfs_create_file("dma", 0444, hello_debugfs_root, NULL, &hello_dma_fops);
+
     return 0;
+
+err_dma:
+    hello_dma_exit();
+err_par_wq:
+    destroy_workqueue(hello_par_wq);
+err_sq_wq:
+    destroy_workqueue(hello_sq_wq);
+err_wq:
+    destroy_workqueue(hello_wq);
+err_queues:
+    free_percpu(hello_queues);
+    return ret;
+}
+
+static void hello_core_exit(void)
+{
+    /* drains whatever is still queued, including deferred buffer frees */
+    destroy_workqueue(hello_sq_wq);
+    free_percpu(hello_queues);
+    destroy_workqueue(hello_wq);
+    hello_dma_exit();
+    destroy_workqueue(hello_par_wq);
+    unregister_shrinker(&hello_pool_shrinker);
+    hello_pool_drain(ULONG_MAX);
+    debugfs_remove_recursive(hello_debugfs_root);
 }
 
 static struct file_operations hello_ops = {
+    .owner          = THIS_MODULE,
     .open           = hello_open,    
     .release        = hello_close,
+    .poll           = hello_poll,
+    .mmap           = hello_mmap,
     .unlocked_ioctl = hello_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl	= hello_ioctl,
 #endif
 };
 
-static int hello_init(void) {
-    int result = 0;
-    static u64 hello_dma_mask = DMA_BIT_MASK(32);
-
-    pr_info("hello init enter!");
+static int hello_chrdev_add(struct dma_buf_dev *hdev, unsigned int idx)
+{
+    int result;
 
-    dev_noA = MKDEV(majorA, 0);
-    result = register_chrdev(majorA, "helloA", &hello_ops);
-    if (result < 0) {
-        pr_info("register chrdev failed! result: %d\n", result);
+    result = hello_dev_init(hdev, idx);
+    if (result)
         return result;
-    }
 
-    clsA = class_create(THIS_MODULE, "hello_clsA");
-    if (IS_ERR(clsA) != 0) {
-        pr_info("class create failed!");
-        result = PTR_ERR(clsA);
+    cdev_init(&hdev->cdev, &hello_ops);
+    hdev->cdev.owner = THIS_MODULE;
+    result = cdev_add(&hdev->cdev, hello_devt + idx, 1);
+    if (result) {
+        pr_info("cdev add failed! result: %d\n", result);
         goto err_1;
     }
 
-    
-
-    cls_devA = device_create(clsA, NULL, dev_noA, NULL, "cdriverA");
-    if (IS_ERR(cls_devA) != 0) {
+    hdev->dev = device_create(hello_cls, NULL, hello_devt + idx, hdev, "%s", hdev->name);
+    if (IS_ERR(hdev->dev) != 0) {
         pr_info("device create failed!");
-        result = PTR_ERR(cls_devA);
+        result = PTR_ERR(hdev->dev);
         goto err_2;
     }
 
-    test_devA.dev = cls_devA;
-    test_devA.dev->dma_mask = &hello_dma_mask;
+    result = hello_dev_setup_dma(hdev, idx);
+    if (result) {
+        pr_info("dma mask setup failed! result: %d\n", result);
+        goto err_3;
+    }
+
+    return 0;
 
+err_3:
+    device_destroy(hello_cls, hello_devt + idx);
+err_2:
+    cdev_del(&hdev->cdev);
+err_1:
+    hello_dev_exit(hdev);
+    return result;
+}
 
-    dev_noB = MKDEV(majorB, 0);
-    result = register_chrdev(majorB, "helloB", &hello_ops);
-    if (result < 0) {
-        pr_info("register chrdev failed! result: %d\n", result);
+static void hello_chrdev_del(struct dma_buf_dev *hdev, unsigned int idx)
+{
+    device_destroy(hello_cls, hello_devt + idx);
+    cdev_del(&hdev->cdev);
+    hello_dev_exit(hdev);
+}
+
+static int hello_init(void) {
+    int result = 0;
+    unsigned int i;
+
+    pr_info("hello init enter!");
+
+    result = hello_core_init();
+    if (result)
         return result;
-    }
 
-    clsB = class_create(THIS_MODULE, "hello_clsB");
-    if (IS_ERR(clsB) != 0) {
-        pr_info("class create failed!");
-        result = PTR_ERR(clsB);
+    hello_devs = kcalloc(ndevs, sizeof(*hello_devs), GFP_KERNEL);
+    if (!hello_devs) {
+        result = -ENOMEM;
         goto err_1;
     }
 
-    cls_devB = device_create(clsB, NULL, dev_noB, NULL, "cdriverB");
-    if (IS_ERR(cls_devB) != 0) {
-        pr_info("device create failed!");
-        result = PTR_ERR(cls_devB);
+    result = alloc_chrdev_region(&hello_devt, 0, ndevs, "hello");
+    if (result < 0) {
+        pr_info("alloc chrdev region failed! result: %d\n", result);
         goto err_2;
     }
 
-    test_devB.dev = cls_devB;
-    test_devB.dev->dma_mask = &hello_dma_mask;
+    hello_cls = class_create(THIS_MODULE, "hello_cls");
+    if (IS_ERR(hello_cls) != 0) {
+        pr_info("class create failed!");
+        result = PTR_ERR(hello_cls);
+        goto err_3;
+    }
+
+    for (i = 0; i < ndevs; i++) {
+        result = hello_chrdev_add(&hello_devs[i], i);
+        if (result)
+            goto err_4;
+    }
 
     return 0;
 
+err_4:
+    while (i--)
+        hello_chrdev_del(&hello_devs[i], i);
+    class_destroy(hello_cls);
+err_3:
+    unregister_chrdev_region(hello_devt, ndevs);
 err_2:
-    class_destroy(clsA);
-    class_destroy(clsB);
+    kfree(hello_devs);
 err_1:
-    unregister_chrdev(majorA, "helloA");
-    unregister_chrdev(majorB, "helloB");
+    hello_core_exit();
     return result;
 }
 
 static void hello_exit(void) {
+    unsigned int i;
+
     pr_info("hello exit enter!");
-    device_destroy(clsA, dev_noA);
-    class_destroy(clsA);
-    device_destroy(clsB, dev_noB);
-    class_destroy(clsB);
-    unregister_chrdev(majorA, "helloA");
-    unregister_chrdev(majorB, "helloB");
+    for (i = 0; i < ndevs; i++)
+        hello_chrdev_del(&hello_devs[i], i);
+    class_destroy(hello_cls);
+    unregister_chrdev_region(hello_devt, ndevs);
+    kfree(hello_devs);
+    hello_core_exit();
 }
 
 module_init(hello_init);
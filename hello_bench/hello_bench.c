@@ -0,0 +1,483 @@
+/*
+ * Throughput/latency benchmark for the hello dma-buf importer
+ * (chrdev/my_test or misc/my_test, both expose the same ioctls).
+ *
+ * Buffers come from the driver's own exporter (the default, hello-huge
+ * for its huge page flavour), a dma-heap or /dev/udmabuf. The driver
+ * writes through dma_buf_vmap(), which udmabuf only supports from 5.11
+ * on, so older kernels need one of the others. For every size from 4 KiB
+ * up to 256 MiB (x4 steps, 64 MiB for udmabuf unless -M says otherwise)
+ * N threads hammer the device and ops/s, MB/s and p50/p99 latency are
+ * reported.
+ *
+ *   hello_bench [-d /dev/cdriverA] [-b] [-s udmabuf|heap|hello|hello-huge]
+ *               [-m oneshot|submit|ring] [-t threads] [-n iterations] [-M max_size_mb]
+ *
+ * oneshot (the default) drives TEST_DRIVERA, or TEST_DRIVERB with -b, with
+ * the dma-buf fd, so every op pays get/attach/map. submit imports once and then only measures
+ * TEST_DRIVER_SUBMIT on the handle. ring does the same work through the
+ * shared rings with an sqpoll thread, so there is no syscall per op.
+ *
+ * After the timed loop every thread checks that the driver string landed
+ * in its buffer; submit and ring also fill the whole buffer through the
+ * imported handle and check it both from mmap and with PATTERN VERIFY.
+ * Any failure is reported and makes the exit status non-zero.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
+#include <linux/udmabuf.h>
+
+#include "hello.h"
+
+enum buf_source { SRC_UDMABUF, SRC_HEAP, SRC_HELLO, SRC_HELLO_HUGE };
+enum bench_mode { MODE_ONESHOT, MODE_SUBMIT, MODE_RING };
+
+static const char *dev_path = "/dev/cdriverA";
+static const char *heap_path = "/dev/dma_heap/system";
+static enum buf_source source = SRC_HELLO;
+static enum bench_mode mode = MODE_ONESHOT;
+static unsigned long oneshot_cmd = TEST_DRIVERA;
+static int nr_threads = 1;
+static int iterations = 1000;
+static size_t max_size;    /* 0 = the source's default */
+
+struct thread_ctx {
+    pthread_t tid;
+    size_t size;
+    uint64_t *lat_ns;
+    int done;
+    int err;
+    int check_failed;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int alloc_udmabuf(size_t size)
+{
+    struct udmabuf_create create = { 0 };
+    int memfd, devfd, fd;
+
+    memfd = memfd_create("hello_bench", MFD_ALLOW_SEALING);
+    if (memfd < 0)
+        return -errno;
+    if (ftruncate(memfd, size) < 0 ||
+        fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0) {
+        fd = -errno;
+        goto out_memfd;
+    }
+
+    devfd = open("/dev/udmabuf", O_RDWR);
+    if (devfd < 0) {
+        fd = -errno;
+        goto out_memfd;
+    }
+
+    create.memfd = memfd;
+    create.flags = UDMABUF_FLAGS_CLOEXEC;
+    create.offset = 0;
+    create.size = size;
+    fd = ioctl(devfd, UDMABUF_CREATE, &create);
+    if (fd < 0)
+        fd = -errno;
+
+    close(devfd);
+out_memfd:
+    close(memfd);
+    return fd;
+}
+
+static int alloc_heap(size_t size)
+{
+    struct dma_heap_allocation_data data = {
+        .len = size,
+        .fd_flags = O_RDWR | O_CLOEXEC,
+    };
+    int heapfd, ret;
+
+    heapfd = open(heap_path, O_RDONLY | O_CLOEXEC);
+    if (heapfd < 0)
+        return -errno;
+
+    ret = ioctl(heapfd, DMA_HEAP_IOCTL_ALLOC, &data);
+    ret = ret < 0 ? -errno : (int)data.fd;
+    close(heapfd);
+    return ret;
+}
+
+static int alloc_hello(int devfd, size_t size, unsigned int flags)
+{
+    struct hello_alloc req = { .size = size, .flags = flags };
+
+    if (ioctl(devfd, TEST_DRIVER_ALLOC, &req) < 0)
+        return -errno;
+    return req.fd;
+}
+
+static int alloc_buf(int devfd, size_t size)
+{
+    switch (source) {
+    case SRC_HEAP:
+        return alloc_heap(size);
+    case SRC_HELLO:
+        return alloc_hello(devfd, size, 0);
+    case SRC_HELLO_HUGE:
+        return alloc_hello(devfd, size, HELLO_ALLOC_HUGE);
+    default:
+        return alloc_udmabuf(size);
+    }
+}
+
+struct ring {
+    struct hello_ring_hdr *hdr;
+    struct hello_sqe *sqes;
+    struct hello_cqe *cqes;
+    size_t size;
+};
+
+static int ring_setup(int devfd, struct ring *r)
+{
+    struct hello_ring_setup setup = {
+        .sq_entries = 64,
+        .flags = HELLO_RING_SQPOLL,
+    };
+    void *mem;
+
+    if (ioctl(devfd, TEST_DRIVER_RING_SETUP, &setup) < 0)
+        return -errno;
+
+    mem = mmap(NULL, setup.mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, devfd, 0);
+    if (mem == MAP_FAILED)
+        return -errno;
+
+    r->hdr = mem;
+    r->sqes = (struct hello_sqe *)((char *)mem + setup.sq_off);
+    r->cqes = (struct hello_cqe *)((char *)mem + setup.cq_off);
+    r->size = setup.mmap_size;
+    return 0;
+}
+
+/* one sqe in, wait for its cqe */
+static int ring_submit(int devfd, struct ring *r, __u32 handle)
+{
+    struct hello_ring_hdr *hdr = r->hdr;
+    struct hello_sqe *sqe;
+    __u32 tail = hdr->sq_tail, head;
+    int res;
+
+    sqe = &r->sqes[tail & hdr->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->op = HELLO_OP_SUBMIT;
+    sqe->handle = handle;
+    __atomic_store_n(&hdr->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->sq_flags, __ATOMIC_RELAXED) & HELLO_SQ_NEED_WAKEUP)
+        ioctl(devfd, TEST_DRIVER_RING_KICK);
+
+    head = hdr->cq_head;
+    while (__atomic_load_n(&hdr->cq_tail, __ATOMIC_ACQUIRE) == head)
+        ;
+    res = r->cqes[head & hdr->cq_mask].res;
+    __atomic_store_n(&hdr->cq_head, head + 1, __ATOMIC_RELEASE);
+    return res;
+}
+
+static int buf_sync(int buffd, __u64 flags)
+{
+    struct dma_buf_sync sync = { .flags = flags };
+
+    return ioctl(buffd, DMA_BUF_IOCTL_SYNC, &sync) < 0 ? -errno : 0;
+}
+
+/* every mode writes "driverX kernel space!" at the start of the buffer */
+static int check_driver_string(int buffd)
+{
+    static const char tail[] = " kernel space!";
+    char *p;
+    int ret;
+
+    p = mmap(NULL, 4096, PROT_READ, MAP_SHARED, buffd, 0);
+    if (p == MAP_FAILED)
+        return -errno;
+
+    ret = buf_sync(buffd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+    if (!ret && (strncmp(p, "driver", 6) || memcmp(p + 7, tail, sizeof(tail))))
+        ret = -EILSEQ;
+    buf_sync(buffd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+
+    munmap(p, 4096);
+    return ret;
+}
+
+/*
+ * Fill the whole buffer with an incrementing pattern through the handle,
+ * then check it from userspace and have the driver verify it too.
+ */
+static int check_pattern(int devfd, int buffd, __u32 handle, size_t size)
+{
+    struct hello_pattern pat = {
+        .handle = handle,
+        .op = HELLO_PATTERN_FILL,
+        .kind = HELLO_PATTERN_INC,
+        .seed = 0x1234567800000000ULL + size,
+    };
+    uint64_t *p;
+    size_t i;
+    int ret;
+
+    if (ioctl(devfd, TEST_DRIVER_PATTERN, &pat) < 0)
+        return -errno;
+
+    p = mmap(NULL, size, PROT_READ, MAP_SHARED, buffd, 0);
+    if (p == MAP_FAILED)
+        return -errno;
+
+    ret = buf_sync(buffd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+    for (i = 0; !ret && i < size / sizeof(*p); i++)
+        if (p[i] != pat.seed + i)
+            ret = -EILSEQ;
+    buf_sync(buffd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+    munmap(p, size);
+    if (ret)
+        return ret;
+
+    pat.op = HELLO_PATTERN_VERIFY;
+    if (ioctl(devfd, TEST_DRIVER_PATTERN, &pat) < 0)
+        return -errno;
+    return 0;
+}
+
+static void *bench_thread(void *arg)
+{
+    struct thread_ctx *ctx = arg;
+    struct hello_import import = { 0 };
+    struct hello_submit submit = { 0 };
+    struct buf_info info = { 0 };
+    struct ring ring = { 0 };
+    uint64_t start;
+    int devfd, buffd, i, ret;
+
+    devfd = open(dev_path, O_RDWR | O_CLOEXEC);
+    if (devfd < 0) {
+        ctx->err = -errno;
+        return NULL;
+    }
+
+    buffd = alloc_buf(devfd, ctx->size);
+    if (buffd < 0) {
+        ctx->err = buffd;
+        goto out_dev;
+    }
+
+    if (mode != MODE_ONESHOT) {
+        import.fd = buffd;
+        if (ioctl(devfd, TEST_DRIVER_IMPORT, &import) < 0) {
+            ctx->err = -errno;
+            goto out_buf;
+        }
+        submit.handle = import.handle;
+        if (mode == MODE_RING) {
+            ret = ring_setup(devfd, &ring);
+            if (ret < 0) {
+                ctx->err = ret;
+                goto out_buf;
+            }
+        }
+    } else {
+        info.fd = buffd;
+        info.size = ctx->size;
+    }
+
+    for (i = 0; i < iterations; i++) {
+        start = now_ns();
+        if (mode == MODE_RING)
+            ret = ring_submit(devfd, &ring, import.handle);
+        else if (mode == MODE_SUBMIT)
+            ret = ioctl(devfd, TEST_DRIVER_SUBMIT, &submit) < 0 ? -errno : 0;
+        else
+            ret = ioctl(devfd, oneshot_cmd, &info) < 0 ? -errno : 0;
+        if (ret < 0) {
+            ctx->err = ret;
+            break;
+        }
+        ctx->lat_ns[i] = now_ns() - start;
+        ctx->done++;
+    }
+
+    if (!ctx->err) {
+        ret = check_driver_string(buffd);
+        if (!ret && mode != MODE_ONESHOT)
+            ret = check_pattern(devfd, buffd, import.handle, ctx->size);
+        if (ret) {
+            ctx->err = ret;
+            ctx->check_failed = 1;
+        }
+    }
+
+    if (ring.hdr)
+        munmap(ring.hdr, ring.size);
+    if (mode != MODE_ONESHOT)
+        ioctl(devfd, TEST_DRIVER_RELEASE, &import.handle);
+out_buf:
+    close(buffd);
+out_dev:
+    close(devfd);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int run_size(size_t size)
+{
+    struct thread_ctx *ctx;
+    uint64_t *all, start, wall;
+    size_t total = 0;
+    int t, err = 0, check_failed = 0;
+    double secs;
+
+    ctx = calloc(nr_threads, sizeof(*ctx));
+    all = calloc((size_t)nr_threads * iterations, sizeof(*all));
+    if (!ctx || !all) {
+        free(ctx);
+        free(all);
+        return -ENOMEM;
+    }
+
+    start = now_ns();
+    for (t = 0; t < nr_threads; t++) {
+        ctx[t].size = size;
+        ctx[t].lat_ns = all + (size_t)t * iterations;
+        pthread_create(&ctx[t].tid, NULL, bench_thread, &ctx[t]);
+    }
+    for (t = 0; t < nr_threads; t++) {
+        pthread_join(ctx[t].tid, NULL);
+        if (ctx[t].err && !err)
+            err = ctx[t].err;
+        check_failed |= ctx[t].check_failed;
+    }
+    wall = now_ns() - start;
+
+    /* pack the samples of all threads together before sorting */
+    for (t = 0; t < nr_threads; t++) {
+        memmove(all + total, ctx[t].lat_ns, ctx[t].done * sizeof(*all));
+        total += ctx[t].done;
+    }
+
+    if (!total) {
+        printf("%10zu KiB  failed: %s\n", size >> 10, strerror(-err));
+        if (err == -ENOMEM && source == SRC_UDMABUF)
+            fprintf(stderr, "udmabuf can't be vmapped on this kernel, try -s hello or -s heap\n");
+    } else {
+        qsort(all, total, sizeof(*all), cmp_u64);
+        secs = wall / 1e9;
+        printf("%10zu KiB %12.0f %12.1f %10.1f %10.1f%s%s\n", size >> 10,
+               total / secs, total * (double)size / secs / (1 << 20),
+               all[total / 2] / 1e3, all[total * 99 / 100] / 1e3,
+               check_failed ? "  data check failed: " : err ? "  (partial) " : "",
+               err ? strerror(-err) : "");
+    }
+
+    free(all);
+    free(ctx);
+    return err;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-d dev] [-b] [-s udmabuf|heap|hello|hello-huge] [-H heap]\n"
+            "          [-m oneshot|submit|ring] [-t threads] [-n iterations] [-M max_size_mb]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    size_t size;
+    int opt, failed = 0;
+
+    while ((opt = getopt(argc, argv, "d:bs:H:m:t:n:M:")) != -1) {
+        switch (opt) {
+        case 'd':
+            dev_path = optarg;
+            break;
+        case 'b':
+            oneshot_cmd = TEST_DRIVERB;
+            break;
+        case 's':
+            if (!strcmp(optarg, "udmabuf"))
+                source = SRC_UDMABUF;
+            else if (!strcmp(optarg, "heap"))
+                source = SRC_HEAP;
+            else if (!strcmp(optarg, "hello"))
+                source = SRC_HELLO;
+            else if (!strcmp(optarg, "hello-huge"))
+                source = SRC_HELLO_HUGE;
+            else
+                usage(argv[0]);
+            break;
+        case 'H':
+            heap_path = optarg;
+            break;
+        case 'm':
+            if (!strcmp(optarg, "oneshot"))
+                mode = MODE_ONESHOT;
+            else if (!strcmp(optarg, "submit"))
+                mode = MODE_SUBMIT;
+            else if (!strcmp(optarg, "ring"))
+                mode = MODE_RING;
+            else
+                usage(argv[0]);
+            break;
+        case 't':
+            nr_threads = atoi(optarg);
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'M':
+            max_size = strtoul(optarg, NULL, 0) << 20;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (nr_threads < 1 || iterations < 1)
+        usage(argv[0]);
+    /* udmabuf caps buffers at udmabuf.size_limit_mb, 64 MiB by default */
+    if (!max_size)
+        max_size = source == SRC_UDMABUF ? 64UL << 20 : 256UL << 20;
+
+    printf("%s, %s, %d thread(s), %d iterations\n", dev_path,
+           mode == MODE_RING ? "ring" : mode == MODE_SUBMIT ? "submit" : "oneshot",
+           nr_threads, iterations);
+    printf("%14s %12s %12s %10s %10s\n", "size", "ops/s", "MB/s", "p50 us", "p99 us");
+
+    for (size = 4096; size <= max_size; size <<= 2)
+        if (run_size(size))
+            failed++;
+
+    return failed ? 1 : 0;
+}
@@ -1,14 +1,349 @@
 #ifndef __HELLO_H__
 #define __HELLO_H__
 
+#include <linux/types.h>
+
 struct buf_info {
     int fd;
     void *buf;
     int size;
 };
 
+/*
+ * What the device does with a buffer, this picks the dma mapping
+ * direction. Anything the driver writes with the cpu needs a mapping
+ * the device reads from (TO_DEVICE or BIDIRECTIONAL), buffers that are
+ * only read on the cpu can use any of them.
+ */
+#define HELLO_DIR_DEFAULT       0   /* the device's own default */
+#define HELLO_DIR_TO_DEVICE     1
+#define HELLO_DIR_FROM_DEVICE   2
+#define HELLO_DIR_BIDIRECTIONAL 3
+
+/*
+ * Import a dma-buf once and keep its attachment and sg_table mapped,
+ * later ioctls refer to the buffer by the returned handle.
+ */
+struct hello_import {
+    __s32 fd;       /* in: dma-buf fd */
+    __u32 handle;   /* out: buffer handle, never 0 */
+    __u64 size;     /* out: dma-buf size in bytes */
+    __u32 dir;      /* in: HELLO_DIR_* */
+    __u32 pad;
+};
+
+/*
+ * CPU work on a previously imported buffer. With HELLO_SUBMIT_ASYNC the
+ * work is queued and fence_fd returns a sync_file that signals once it
+ * is done; poll() on the device fd reports EPOLLIN when the file is idle,
+ * unless it has a ring (see below).
+ * Only [offset, offset + length) is touched and cache maintained, a zero
+ * length means up to the end of the buffer.
+ */
+struct hello_submit {
+    __u32 handle;
+    __u32 flags;    /* HELLO_SUBMIT_* */
+    __s32 fence_fd; /* out: sync_file fd for HELLO_SUBMIT_ASYNC */
+    __u32 pad;
+    __u64 offset;
+    __u64 length;
+};
+
+#define HELLO_SUBMIT_ASYNC  (1 << 0)
+
+/* async submissions a single open file may have in flight */
+#define HELLO_MAX_INFLIGHT  64
+
+/*
+ * One entry of a batched submission. A non-zero handle selects a buffer
+ * from TEST_DRIVER_IMPORT, otherwise fd is imported just for this entry.
+ */
+struct hello_batch_entry {
+    __s32 fd;
+    __u32 handle;
+    __u32 dir;      /* HELLO_DIR_* for fd, must be 0 with a handle */
+    __s32 status;   /* out: 0 or -errno for this entry */
+    __u64 offset;   /* same meaning as in struct hello_submit */
+    __u64 length;
+};
+
+struct hello_batch {
+    __u64 entries;  /* user pointer to struct hello_batch_entry[count] */
+    __u32 count;    /* at most HELLO_BATCH_MAX */
+    __u32 flags;    /* must be 0 */
+};
+
+#define HELLO_BATCH_MAX     256
+
+/* allocate a dma-buf exported by the hello driver itself */
+struct hello_alloc {
+    __u64 size;     /* in: requested size, out: page aligned size */
+    __u32 flags;    /* HELLO_ALLOC_* */
+    __s32 fd;       /* out: dma-buf fd */
+};
+
+/*
+ * Back the buffer with PMD sized pages where the allocator can find them,
+ * size is rounded up to match. That is 2 MiB with 4 KiB base pages, e.g.
+ * x86-64 and 4K-page arm64. With larger PMDs the page order is capped at
+ * MAX_ORDER - 1.
+ */
+#define HELLO_ALLOC_HUGE    (1 << 0)
+
+/*
+ * Copy length bytes between two buffers inside the kernel. src and dst
+ * are dma-buf fds, or handles of this file with HELLO_COPY_HANDLES. A
+ * zero length copies up to the end of the source.
+ */
+struct hello_copy {
+    __s32 src;
+    __s32 dst;
+    __u32 flags;    /* HELLO_COPY_* */
+    __u32 pad;
+    __u64 src_offset;
+    __u64 dst_offset;
+    __u64 length;
+};
+
+#define HELLO_COPY_HANDLES  (1 << 0)
+
+/*
+ * DMA layout of a buffer as mapped for this device. A non-zero handle
+ * selects an imported buffer, otherwise fd is imported for the query.
+ * Segments that follow each other in DMA address space count as one
+ * contiguous run.
+ */
+struct hello_sg_seg {
+    __u64 addr;     /* dma address */
+    __u64 len;
+};
+
+#define HELLO_SG_HIST_BUCKETS   32
+
+struct hello_sg_query {
+    __s32 fd;
+    __u32 handle;
+    __u32 flags;        /* out: HELLO_SG_* */
+    __u32 nents;        /* out: dma segments */
+    __u32 orig_nents;   /* out: cpu side segments before iommu merging */
+    __u32 nr_runs;      /* out: dma contiguous runs */
+    __u64 size;         /* out: dma-buf size in bytes */
+    __u64 largest_run;  /* out: longest dma contiguous run in bytes */
+    __u64 smallest_seg; /* out: shortest dma segment in bytes */
+    /* out: dma segments with length in [2^i, 2^(i + 1)) */
+    __u32 hist[HELLO_SG_HIST_BUCKETS];
+    __u64 segs;         /* in: user pointer to struct hello_sg_seg[max_segs], or 0 */
+    __u32 max_segs;     /* in: room in segs, at most HELLO_SG_QUERY_MAX */
+    __u32 nr_segs;      /* out: entries written to segs */
+};
+
+#define HELLO_SG_IOMMU_MERGED   (1 << 0)
+#define HELLO_SG_BOUNCED        (1 << 1)    /* some segments go through swiotlb */
+#define HELLO_SG_QUERY_MAX      4096
+
+/*
+ * Import plain user memory, malloc'd or hugetlb, without copying it into
+ * a dma-buf first. addr and size must be page aligned. The handle works
+ * with every ioctl that takes one and is dropped with TEST_DRIVER_RELEASE.
+ * Once the range is unmapped or remapped the pages are unpinned and the
+ * handle fails with -EINVAL until released; import the range again.
+ */
+struct hello_userptr_import {
+    __u64 addr;
+    __u64 size;
+    __u32 dir;      /* HELLO_DIR_* */
+    __u32 handle;   /* out */
+};
+
+/*
+ * Queue a copy or fill on the driver's emulated dma engine. src and dst
+ * are handles of this file, a zero length means up to the end of the
+ * source (COPY) or destination (FILL). fence_fd returns a sync_file that
+ * signals once the simulated transfer is done, -EAGAIN means the channel
+ * already holds module parameter dma_chan_depth descriptors.
+ */
+struct hello_dma {
+    __u32 op;           /* HELLO_DMA_OP_* */
+    __u32 channel;      /* in: channel or HELLO_DMA_ANY_CHANNEL, out: channel used */
+    __u32 src;          /* ignored for FILL */
+    __u32 dst;
+    __u64 src_offset;
+    __u64 dst_offset;
+    __u64 length;
+    __u64 pattern;      /* FILL: byte value in the low 8 bits */
+    __s32 fence_fd;     /* out */
+    __u32 flags;        /* must be 0 */
+};
+
+#define HELLO_DMA_OP_COPY       0
+#define HELLO_DMA_OP_FILL       1
+#define HELLO_DMA_ANY_CHANNEL   0xffffffff
+
+/*
+ * Submission/completion rings. TEST_DRIVER_RING_SETUP sizes them (entry
+ * counts are rounded up to a power of two) and returns where they live in
+ * the mapping userspace then mmaps from the device fd at offset 0:
+ * struct hello_ring_hdr first, sq_entries sqes at sq_off, cq_entries
+ * cqes at cq_off. Handles are the ones from TEST_DRIVER_IMPORT.
+ *
+ * Submitting: fill sqes[sq_tail & sq_mask], store-release sq_tail, then
+ * TEST_DRIVER_RING_KICK. With HELLO_RING_SQPOLL a kernel thread polls
+ * sq_tail and the kick is only needed while sq_flags has
+ * HELLO_SQ_NEED_WAKEUP. Completions appear at cqes[cq_head & cq_mask]
+ * up to cq_tail, in submission order. Once the file has a ring, poll()
+ * reports EPOLLIN only while there are cqes to reap; wait on the fences
+ * of async TEST_DRIVER_SUBMITs instead. The kernel stops taking sqes
+ * while the cq is full: after store-releasing cq_head, kick again if sqes
+ * are still queued (with HELLO_RING_SQPOLL, if sq_flags has
+ * HELLO_SQ_NEED_WAKEUP).
+ */
+struct hello_ring_setup {
+    __u32 sq_entries;   /* in/out, at most HELLO_RING_MAX_ENTRIES */
+    __u32 cq_entries;   /* in/out, 0 picks twice sq_entries */
+    __u32 flags;        /* HELLO_RING_* */
+    __u32 sq_idle_ms;   /* sqpoll busy polls this long before sleeping, 0 = 10,
+                           at most HELLO_RING_MAX_IDLE_MS */
+    __u64 mmap_size;    /* out */
+    __u32 sq_off;       /* out */
+    __u32 cq_off;       /* out */
+};
+
+#define HELLO_RING_SQPOLL       (1 << 0)
+#define HELLO_RING_MAX_ENTRIES  4096
+#define HELLO_RING_MAX_IDLE_MS  1000
+
+struct hello_ring_hdr {
+    __u32 sq_head;      /* kernel */
+    __u32 sq_tail;      /* user */
+    __u32 sq_mask;
+    __u32 sq_flags;     /* kernel, HELLO_SQ_* */
+    __u32 cq_head;      /* user */
+    __u32 cq_tail;      /* kernel */
+    __u32 cq_mask;
+    __u32 pad;
+};
+
+#define HELLO_SQ_NEED_WAKEUP    (1 << 0)
+
+#define HELLO_OP_NOP        0
+#define HELLO_OP_SUBMIT     1   /* same work as TEST_DRIVER_SUBMIT */
+#define HELLO_OP_COPY       2   /* src -> handle, like TEST_DRIVER_COPY */
+#define HELLO_OP_FILL       3   /* low 8 bits of pattern */
+
+struct hello_sqe {
+    __u8 op;            /* HELLO_OP_* */
+    __u8 pad[3];
+    __u32 handle;       /* the buffer, destination for COPY */
+    __u32 src;          /* COPY source handle */
+    __u32 flags;        /* must be 0 */
+    __u64 offset;
+    __u64 src_offset;
+    __u64 length;       /* 0 = to the end, of the source for COPY */
+    __u64 pattern;
+    __u64 user_data;    /* copied to the cqe */
+    __u64 resv;
+};
+
+struct hello_cqe {
+    __u64 user_data;
+    __s32 res;          /* 0 or -errno */
+    __u32 seq;          /* index of the sqe, counting from 0 */
+};
+
+/*
+ * Write a test pattern over an imported buffer, or check it against one.
+ * Patterns are native endian 64-bit words keyed by their position in the
+ * buffer (byte offset / 8), so a range checks the same bytes that a fill
+ * of the whole buffer wrote there:
+ *   CONST  every word is seed
+ *   INC    seed + index
+ *   PRNG   splitmix64 seeded with seed, index picks the step
+ * VERIFY fails with EBADMSG and reports the first differing byte.
+ */
+struct hello_pattern {
+    __u32 handle;
+    __u32 op;       /* HELLO_PATTERN_FILL or HELLO_PATTERN_VERIFY */
+    __u32 kind;     /* HELLO_PATTERN_CONST, _INC or _PRNG */
+    __u32 flags;    /* must be 0 */
+    __u64 offset;
+    __u64 length;   /* 0 = to the end */
+    __u64 seed;
+    __u64 mismatch; /* out: buffer offset of the first bad byte, ~0 if none */
+};
+
+#define HELLO_PATTERN_FILL      0
+#define HELLO_PATTERN_VERIFY    1
+
+#define HELLO_PATTERN_CONST     0
+#define HELLO_PATTERN_INC       1
+#define HELLO_PATTERN_PRNG      2
+
+/*
+ * CRC-32C of a range of an imported buffer. crc is the raw running value
+ * in and out, start with ~0 and invert the result for the usual CRC-32C,
+ * or pass the previous result to continue over the next range.
+ */
+struct hello_checksum {
+    __u32 handle;
+    __u32 flags;    /* must be 0 */
+    __u64 offset;
+    __u64 length;   /* 0 = to the end */
+    __u32 crc;      /* in: seed, out: crc32c */
+    __u32 pad;
+};
+
+/*
+ * A short chain of ops run fused over the same length: the driver walks
+ * all the buffers together a page at a time and applies every op, in
+ * order, before moving on. "copy A to B, then crc32c of B" thus reads B
+ * back while it is still in cache instead of in a second pass.
+ *   COPY    dst = src
+ *   FILL    dst = pattern kind/seed, as in struct hello_pattern
+ *   XOR     dst ^= src
+ *   CRC32C  seed in: running crc, out: crc32c of src (see hello_checksum)
+ * Handles are from TEST_DRIVER_IMPORT. The ops array is written back with
+ * the crc results. A range one op writes may be used by other ops only at
+ * the same offset of the same buffer, partial overlaps fail with EINVAL.
+ */
+struct hello_chain_op {
+    __u32 op;           /* HELLO_CHAIN_* */
+    __u32 dst;          /* COPY, FILL, XOR */
+    __u32 src;          /* COPY, XOR, CRC32C */
+    __u32 kind;         /* FILL: HELLO_PATTERN_* */
+    __u64 dst_offset;
+    __u64 src_offset;
+    __u64 seed;
+};
+
+struct hello_chain {
+    __u64 ops;      /* user pointer to struct hello_chain_op[count] */
+    __u32 count;    /* at most HELLO_CHAIN_MAX */
+    __u32 flags;    /* must be 0 */
+    __u64 length;   /* bytes every op covers, not 0 */
+};
+
+#define HELLO_CHAIN_COPY    0
+#define HELLO_CHAIN_FILL    1
+#define HELLO_CHAIN_XOR     2
+#define HELLO_CHAIN_CRC32C  3
+#define HELLO_CHAIN_MAX     8
+
 #define HELLO_MAGIC  't'
 #define TEST_DRIVERA    (_IOWR(HELLO_MAGIC, 0x1, struct buf_info))
 #define TEST_DRIVERB    (_IOWR(HELLO_MAGIC, 0x2, struct buf_info))
+#define TEST_DRIVER_IMPORT  (_IOWR(HELLO_MAGIC, 0x3, struct hello_import))
+#define TEST_DRIVER_RELEASE (_IOW(HELLO_MAGIC, 0x4, __u32))
+#define TEST_DRIVER_SUBMIT  (_IOWR(HELLO_MAGIC, 0x5, struct hello_submit))
+#define TEST_DRIVER_BATCH   (_IOW(HELLO_MAGIC, 0x6, struct hello_batch))
+#define TEST_DRIVER_ALLOC   (_IOWR(HELLO_MAGIC, 0x7, struct hello_alloc))
+#define TEST_DRIVER_COPY    (_IOW(HELLO_MAGIC, 0x8, struct hello_copy))
+#define TEST_DRIVER_QUERY_SG (_IOWR(HELLO_MAGIC, 0x9, struct hello_sg_query))
+#define TEST_DRIVER_USERPTR (_IOWR(HELLO_MAGIC, 0xa, struct hello_userptr_import))
+#define TEST_DRIVER_DMA     (_IOWR(HELLO_MAGIC, 0xb, struct hello_dma))
+#define TEST_DRIVER_RING_SETUP  (_IOWR(HELLO_MAGIC, 0xc, struct hello_ring_setup))
+#define TEST_DRIVER_RING_KICK   (_IO(HELLO_MAGIC, 0xd))
+#define TEST_DRIVER_PATTERN (_IOWR(HELLO_MAGIC, 0xe, struct hello_pattern))
+#define TEST_DRIVER_CHECKSUM    (_IOWR(HELLO_MAGIC, 0xf, struct hello_checksum))
+#define TEST_DRIVER_CHAIN   (_IOW(HELLO_MAGIC, 0x10, struct hello_chain))
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,109 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM hello
+
+#if !defined(__HELLO_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __HELLO_TRACE_H__
+
+#include <linux/tracepoint.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-direction.h>
+#include <linux/fs.h>
+
+/* every event identifies the buffer by its dma-buf inode and size */
+DECLARE_EVENT_CLASS(hello_dma_buf,
+    TP_PROTO(struct dma_buf *dmabuf),
+    TP_ARGS(dmabuf),
+    TP_STRUCT__entry(
+        __field(unsigned long, ino)
+        __field(size_t, size)
+    ),
+    TP_fast_assign(
+        __entry->ino = file_inode(dmabuf->file)->i_ino;
+        __entry->size = dmabuf->size;
+    ),
+    TP_printk("ino=%lu size=%zu", __entry->ino, __entry->size)
+);
+
+DEFINE_EVENT(hello_dma_buf, hello_dma_buf_get,
+    TP_PROTO(struct dma_buf *dmabuf),
+    TP_ARGS(dmabuf)
+);
+
+DEFINE_EVENT(hello_dma_buf, hello_dma_buf_attach,
+    TP_PROTO(struct dma_buf *dmabuf),
+    TP_ARGS(dmabuf)
+);
+
+DEFINE_EVENT(hello_dma_buf, hello_dma_buf_vmap,
+    TP_PROTO(struct dma_buf *dmabuf),
+    TP_ARGS(dmabuf)
+);
+
+DEFINE_EVENT(hello_dma_buf, hello_dma_buf_unmap,
+    TP_PROTO(struct dma_buf *dmabuf),
+    TP_ARGS(dmabuf)
+);
+
+DEFINE_EVENT(hello_dma_buf, hello_dma_buf_put,
+    TP_PROTO(struct dma_buf *dmabuf),
+    TP_ARGS(dmabuf)
+);
+
+TRACE_EVENT(hello_dma_buf_map,
+    TP_PROTO(struct dma_buf *dmabuf, struct sg_table *sgt,
+             enum dma_data_direction dir),
+    TP_ARGS(dmabuf, sgt, dir),
+    TP_STRUCT__entry(
+        __field(unsigned long, ino)
+        __field(size_t, size)
+        __field(unsigned int, nents)
+        __field(u64, dma_len)
+        __field(int, dir)
+    ),
+    TP_fast_assign(
+        struct scatterlist *sg;
+        int i;
+
+        __entry->ino = file_inode(dmabuf->file)->i_ino;
+        __entry->size = dmabuf->size;
+        __entry->nents = sgt->nents;
+        __entry->dma_len = 0;
+        for_each_sgtable_dma_sg(sgt, sg, i)
+            __entry->dma_len += sg_dma_len(sg);
+        __entry->dir = dir;
+    ),
+    TP_printk("ino=%lu size=%zu nents=%u dma_len=%llu dir=%d",
+              __entry->ino, __entry->size, __entry->nents,
+              __entry->dma_len, __entry->dir)
+);
+
+TRACE_EVENT(hello_dma_buf_cpu_access,
+    TP_PROTO(struct dma_buf *dmabuf, u64 offset, u64 length,
+             enum dma_data_direction dir),
+    TP_ARGS(dmabuf, offset, length, dir),
+    TP_STRUCT__entry(
+        __field(unsigned long, ino)
+        __field(size_t, size)
+        __field(u64, offset)
+        __field(u64, length)
+        __field(int, dir)
+    ),
+    TP_fast_assign(
+        __entry->ino = file_inode(dmabuf->file)->i_ino;
+        __entry->size = dmabuf->size;
+        __entry->offset = offset;
+        __entry->length = length;
+        __entry->dir = dir;
+    ),
+    TP_printk("ino=%lu size=%zu offset=%llu length=%llu dir=%d",
+              __entry->ino, __entry->size, __entry->offset,
+              __entry->length, __entry->dir)
+);
+
+#endif /* __HELLO_TRACE_H__ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hello_trace
+#include <trace/define_trace.h>